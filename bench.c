@@ -0,0 +1,372 @@
+/* Benchmark driver for the event engine of k2k.c.
+ *
+ * Built per configuration like k2k itself (see `make bench`). It replays
+ * synthetic workloads, or the recorded traces given as arguments, through
+ * `process_input()` with in-memory I/O and prints one JSON object per
+ * workload to stdout.
+ *
+ * Usage: bench-CONFIG [NAME [TRACE...]]
+ *
+ * A trace is a recording made by `k2k -R`, which is replayed one recorded
+ * read at a time, or a raw stream of `struct input_event`s, e.g. as saved
+ * by `intercept -g $DEVNODE >trace`. */
+#define _XOPEN_SOURCE 500
+#include <stdio.h> /* printf(), fopen() */
+#include <sys/types.h> /* ssize_t */
+#include <stddef.h> /* size_t */
+#include <sys/uio.h> /* struct iovec */
+
+#define BENCH
+
+static ssize_t input_read(void *buf, size_t len);
+static ssize_t output_writev(struct iovec const *iov, int iovcnt);
+
+#include "k2k.c"
+
+#ifndef BENCH_ROUNDS
+/* Report the fastest of this many runs of each workload. */
+# define BENCH_ROUNDS 5
+#endif
+
+#ifndef BENCH_EVENTS
+/* Approximate length of synthetic workloads. */
+# define BENCH_EVENTS 200000
+#endif
+
+/** A workload: events and the number of events each read(2) returns. */
+static struct trace {
+    char const *name;
+    struct input_event *events;
+    size_t nevents;
+    size_t *chunks;
+    size_t nchunks;
+    size_t cap_events, cap_chunks;
+    size_t chunked; /** Number of events covered by `chunks`. */
+    long long time; /** Timestamp of the next event in usec. */
+} trace;
+
+static size_t trace_ev, trace_chunk, trace_chunk_ev;
+static unsigned long nreads, nwrites;
+
+static ssize_t
+input_read(void *buf, size_t len) {
+    size_t n;
+
+    ++nreads;
+    if (trace_chunk == trace.nchunks)
+        return 0;
+
+    n = trace.chunks[trace_chunk] - trace_chunk_ev;
+    if (n > len / sizeof *trace.events)
+        n = len / sizeof *trace.events;
+    memcpy(buf, &trace.events[trace_ev], n * sizeof *trace.events);
+    trace_ev += n;
+    if ((trace_chunk_ev += n) == trace.chunks[trace_chunk])
+        ++trace_chunk, trace_chunk_ev = 0;
+    return n * sizeof *trace.events;
+}
+
+static ssize_t
+output_writev(struct iovec const *iov, int iovcnt) {
+    ssize_t len = 0;
+
+    ++nwrites;
+    while (iovcnt-- > 0)
+        len += iov++->iov_len;
+    return len;
+}
+
+static void *
+xrealloc(void *p, size_t size) {
+    if (!(p = realloc(p, size))) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+static void
+trace_event(int type, int code, int value) {
+    struct input_event *e;
+
+    if (trace.nevents == trace.cap_events) {
+        trace.cap_events = trace.cap_events ? 2 * trace.cap_events : 4096;
+        trace.events = xrealloc(trace.events, trace.cap_events * sizeof *trace.events);
+    }
+    e = &trace.events[trace.nevents++];
+    memset(e, 0, sizeof *e);
+    e->input_event_sec = trace.time / 1000000;
+    e->input_event_usec = trace.time % 1000000;
+    e->type = type;
+    e->code = code;
+    e->value = value;
+}
+
+/** End the current read(2) worth of events. */
+static void
+trace_chunk_end(void) {
+    size_t const n = trace.nevents - trace.chunked;
+
+    if (n == 0)
+        return;
+
+    if (trace.nchunks == trace.cap_chunks) {
+        trace.cap_chunks = trace.cap_chunks ? 2 * trace.cap_chunks : 1024;
+        trace.chunks = xrealloc(trace.chunks, trace.cap_chunks * sizeof *trace.chunks);
+    }
+    trace.chunks[trace.nchunks++] = n;
+    trace.chunked = trace.nevents;
+}
+
+/** Append a key frame as a keyboard reports it. */
+static void
+trace_key(int code, int value, int delay_msec) {
+    trace.time += delay_msec * 1000LL;
+    trace_event(EV_MSC, MSC_SCAN, code);
+    trace_event(EV_KEY, code, value);
+    trace_event(EV_SYN, SYN_REPORT, 0);
+}
+
+static unsigned long long rng = 0x9e3779b97f4a7c15ULL;
+
+static unsigned
+rand_below(unsigned n) {
+    rng ^= rng << 13, rng ^= rng >> 7, rng ^= rng << 17;
+    return rng % n;
+}
+
+static void
+trace_reset(char const *name) {
+    trace.name = name;
+    trace.nevents = 0;
+    trace.nchunks = 0;
+    trace.chunked = 0;
+    trace.time = 0;
+}
+
+static int const TYPING_KEYS[] = {
+    KEY_Q, KEY_W, KEY_E, KEY_R, KEY_T, KEY_Y, KEY_U, KEY_I, KEY_O, KEY_P,
+    KEY_A, KEY_S, KEY_D, KEY_F, KEY_G, KEY_H, KEY_J, KEY_K, KEY_L, KEY_SEMICOLON,
+    KEY_Z, KEY_X, KEY_C, KEY_V, KEY_B, KEY_N, KEY_M, KEY_COMMA, KEY_DOT,
+    KEY_SPACE, KEY_SPACE, KEY_SPACE,
+};
+
+/* Fast typing with overlapping key presses, one frame per read. */
+static void
+gen_typing(void) {
+    int prev = KEY_RESERVED;
+
+    trace_reset("typing");
+    while (trace.nevents < BENCH_EVENTS) {
+        int key = TYPING_KEYS[rand_below(ARRAY_LEN(TYPING_KEYS))];
+        if (key == prev)
+            continue;
+        trace_key(key, EVENT_VALUE_KEYDOWN, 40 + rand_below(80)), trace_chunk_end();
+        if (prev != KEY_RESERVED)
+            trace_key(prev, EVENT_VALUE_KEYUP, 10), trace_chunk_end();
+        prev = key;
+    }
+    trace_key(prev, EVENT_VALUE_KEYUP, 50), trace_chunk_end();
+}
+
+static int const HOLD_KEYS[] = {
+    KEY_A, KEY_S, KEY_D, KEY_F, KEY_J, KEY_K, KEY_L, KEY_SEMICOLON, KEY_SPACE,
+    KEY_CAPSLOCK, KEY_E, KEY_I,
+};
+
+/* Hold a home-row key, let it autorepeat, press other keys under it. */
+static void
+gen_holds(void) {
+    trace_reset("holds");
+    while (trace.nevents < BENCH_EVENTS) {
+        int hold = HOLD_KEYS[rand_below(ARRAY_LEN(HOLD_KEYS))];
+        int i, n;
+
+        trace_key(hold, EVENT_VALUE_KEYDOWN, 300), trace_chunk_end();
+        for (i = 0, n = rand_below(8); i < n; ++i)
+            trace_key(hold, EVENT_VALUE_KEYREPEAT, i ? 33 : 250), trace_chunk_end();
+        for (i = 0, n = 1 + rand_below(3); i < n; ++i) {
+            int key = TYPING_KEYS[rand_below(ARRAY_LEN(TYPING_KEYS))];
+            if (key == hold)
+                continue;
+            trace_key(key, EVENT_VALUE_KEYDOWN, 100), trace_chunk_end();
+            trace_key(key, EVENT_VALUE_KEYUP, 60), trace_chunk_end();
+        }
+        trace_key(hold, EVENT_VALUE_KEYUP, 80), trace_chunk_end();
+    }
+}
+
+static int const CHORDS[][3] = {
+    { KEY_LEFTSHIFT, KEY_RIGHTSHIFT },
+    { KEY_LEFTCTRL, KEY_RIGHTCTRL },
+    { KEY_LEFTMETA, KEY_RIGHTMETA },
+    { KEY_LEFTMETA, KEY_F8 },
+    { KEY_LEFTMETA, KEY_F10 },
+    { KEY_LEFTMETA, KEY_PAGEUP },
+    { KEY_LEFTMETA, KEY_LEFTCTRL, KEY_PAGEDOWN },
+    { KEY_LEFTCTRL, KEY_LEFTSHIFT, KEY_T },
+    { KEY_D, KEY_F, KEY_J },
+};
+
+/* Modifier and multi-key combinations. */
+static void
+gen_chords(void) {
+    trace_reset("chords");
+    while (trace.nevents < BENCH_EVENTS) {
+        int const *chord = CHORDS[rand_below(ARRAY_LEN(CHORDS))];
+        int i, n;
+
+        for (n = 0; n < ARRAY_LEN(*CHORDS) && chord[n] != KEY_RESERVED; ++n)
+            trace_key(chord[n], EVENT_VALUE_KEYDOWN, n ? 20 : 200), trace_chunk_end();
+        for (i = 0; i < n; ++i)
+            trace_key(chord[i], EVENT_VALUE_KEYUP, 30), trace_chunk_end();
+    }
+}
+
+/* High-rate mouse movement with a few button clicks, read in bursts as a
+ * busy reader would see it. */
+static void
+gen_mouse(void) {
+    int frames = 0;
+
+    trace_reset("mouse");
+    while (trace.nevents < BENCH_EVENTS) {
+        trace.time += 1000;
+        trace_event(EV_REL, REL_X, (int)rand_below(21) - 10);
+        trace_event(EV_REL, REL_Y, (int)rand_below(21) - 10);
+        if (rand_below(50) == 0)
+            trace_event(EV_REL, REL_WHEEL, rand_below(2) ? 1 : -1);
+        if (rand_below(200) == 0) {
+            int const value = !(frames & 1);
+            trace_event(EV_MSC, MSC_SCAN, 0x90001);
+            trace_event(EV_KEY, BTN_LEFT, value);
+        }
+        trace_event(EV_SYN, SYN_REPORT, 0);
+        if (++frames % (1 + rand_below(32)) == 0)
+            trace_chunk_end();
+    }
+    trace_event(EV_KEY, BTN_LEFT, EVENT_VALUE_KEYUP);
+    trace_event(EV_SYN, SYN_REPORT, 0);
+    trace_chunk_end();
+}
+
+/** Load the batches of recording `base` of `size` bytes from `off`. */
+static void
+load_recording(char const *base, size_t size, size_t off) {
+    struct record_batch const *b;
+
+    while ((b = record_next(base, size, &off))) {
+        size_t i;
+
+        for (i = 0; i < b->nevents; ++i) {
+            struct input_event e;
+
+            record_events(b, i, 1, &e);
+            trace.time = EVENT_TIME_USEC(e);
+            trace_event(e.type, e.code, e.value);
+        }
+        trace_chunk_end();
+    }
+}
+
+/** Load a recorded trace, one frame per read unless it is a recording. */
+static void
+load_trace(char const *path) {
+    FILE *f;
+    struct input_event e;
+    char *data = NULL;
+    size_t size = 0, off;
+
+    trace_reset(path);
+    if (!(f = fopen(path, "rb"))) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    for (;;) {
+        data = xrealloc(data, size + 65536);
+        if (!(off = fread(data + size, 1, 65536, f)))
+            break;
+        size += off;
+    }
+    fclose(f);
+
+    if ((off = record_start(data, size))) {
+        load_recording(data, size, off);
+    } else {
+        for (off = 0; size - off >= sizeof e; off += sizeof e) {
+            memcpy(&e, data + off, sizeof e);
+            trace.time = EVENT_TIME_USEC(e);
+            trace_event(e.type, e.code, e.value);
+            if (e.type == EV_SYN)
+                trace_chunk_end();
+        }
+        trace_chunk_end();
+    }
+    free(data);
+}
+
+static long long
+now_nsec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void
+run_trace(char const *config) {
+    long long best = -1;
+    int round;
+
+    for (round = 0; round < BENCH_ROUNDS; ++round) {
+        long long start;
+
+        /* Every round starts where the first one did, with no key down
+         * and no rule armed. */
+        trace_ev = 0, trace_chunk = 0, trace_chunk_ev = 0;
+        nreads = 0, nwrites = 0;
+        revlen = 0, riev = 0, revpartial = 0;
+        wevhead = 0, wevlen = 0, wevframes = 0, wevframe_len = 0, wevoff = 0;
+        memset(matrix, 0, sizeof matrix);
+        state_reset();
+
+        start = now_nsec();
+        process_input();
+        start = now_nsec() - start;
+        if (best < 0 || start < best)
+            best = start;
+    }
+
+    printf("{\"config\":\"%s\",\"workload\":\"%s\",\"events\":%zu,"
+           "\"ns_per_event\":%.2f,\"events_per_sec\":%.0f,"
+           "\"reads\":%lu,\"writes\":%lu,\"syscalls_per_event\":%.4f}\n",
+           config, trace.name, trace.nevents,
+           (double)best / trace.nevents,
+           trace.nevents * 1e9 / (best ? best : 1),
+           nreads, nwrites,
+           (double)(nreads + nwrites) / trace.nevents);
+}
+
+int
+main(int argc, char *argv[]) {
+    char const *const config = argc > 1 ? argv[1] : "k2k";
+    int i;
+
+    if (argc > 2) {
+        for (i = 2; i < argc; ++i) {
+            load_trace(argv[i]);
+            run_trace(config);
+        }
+    } else {
+        static void (*const GENERATORS[])(void) = {
+            gen_typing, gen_holds, gen_chords, gen_mouse,
+        };
+
+        for (i = 0; i < ARRAY_LEN(GENERATORS); ++i) {
+            GENERATORS[i]();
+            run_trace(config);
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+/* vi:set ft=c: */
@@ -0,0 +1,146 @@
+/* Print the counters that a k2k started with `-m STATFILE` keeps of what its
+ * rules did. The file is read as it is, so it does not disturb k2k.
+ *
+ * Usage: k2k-stat [-i SECONDS] STATFILE... */
+#define _XOPEN_SOURCE 500
+#include <stdio.h> /* printf() */
+#include <stdlib.h> /* EXIT_FAILURE */
+#include <string.h> /* memcmp() */
+#include <unistd.h> /* getopt(), sleep() */
+#include <fcntl.h> /* open() */
+#include <sys/mman.h> /* mmap() */
+#include <sys/stat.h> /* fstat() */
+
+#include "stats.h"
+
+/** Print counters of `size` bytes at `base`. Return whether they make
+ * sense. */
+static int
+print_stats(char const *base, size_t size) {
+    struct stats_header const *const h = (void const *)base;
+    size_t off = sizeof *h;
+    unsigned stage, i;
+
+    if (size < sizeof *h
+        || memcmp(h->magic, STATS_MAGIC, sizeof h->magic)
+        || h->version != STATS_VERSION)
+        return 0;
+
+    if (h->ring_size)
+        printf("reader ring size %u high %u full %u\n",
+               (unsigned)h->ring_size, (unsigned)h->ring_high, (unsigned)h->ring_full);
+    for (stage = 0; stage < h->nstages; ++stage) {
+        struct stats_stage const *const s = (void const *)(base + off);
+        uint64_t const *map;
+        struct stats_tap const *tap;
+        struct stats_multi const *multi;
+        uint64_t const *layer;
+
+        if (size - off < sizeof *s
+            || size - off < STATS_STAGE_SIZE((size_t)s->nmap, (size_t)s->ntap, (size_t)s->nmulti, (size_t)s->nlayer))
+            return 0;
+        map = (void const *)(s + 1);
+        tap = (void const *)(map + s->nmap);
+        multi = (void const *)(tap + s->ntap);
+        layer = (void const *)(multi + s->nmulti);
+
+        printf("stage %u %.*s\n", stage, (int)sizeof s->name, s->name);
+        printf("  events in %llu out %llu\n",
+               (unsigned long long)s->events_in,
+               (unsigned long long)s->events_out);
+        printf("  dropped scan %llu map %llu consumed %llu\n",
+               (unsigned long long)s->scan_dropped,
+               (unsigned long long)s->map_dropped,
+               (unsigned long long)s->consumed);
+        for (i = 0; i < s->nmap; ++i)
+            printf("  map #%u hits %llu\n", i, (unsigned long long)map[i]);
+        for (i = 0; i < s->ntap; ++i)
+            printf("  tap #%u tapped %llu held %llu repeated %llu late_tap %llu ignored %llu\n",
+                   i,
+                   (unsigned long long)tap[i].tapped,
+                   (unsigned long long)tap[i].held,
+                   (unsigned long long)tap[i].repeated,
+                   (unsigned long long)tap[i].late_tap,
+                   (unsigned long long)tap[i].ignored);
+        for (i = 0; i < s->nmulti; ++i)
+            printf("  multi #%u down %llu up %llu missed %llu\n",
+                   i,
+                   (unsigned long long)multi[i].down,
+                   (unsigned long long)multi[i].up,
+                   (unsigned long long)multi[i].missed);
+        for (i = 0; i < s->nlayer; ++i)
+            printf("  layer #%u hits %llu\n", i, (unsigned long long)layer[i]);
+
+        off += STATS_STAGE_SIZE(s->nmap, s->ntap, s->nmulti, s->nlayer);
+    }
+    return 1;
+}
+
+/** Print counters in file `path`. Return 0 on success, or -1 after telling
+ * why not. */
+static int
+print_file(char const *path) {
+    struct stat st;
+    void *base;
+    int fd, ok;
+
+    if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+        perror(path);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    if (!st.st_size) {
+        close(fd);
+        ok = 0;
+    } else {
+        base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (base == MAP_FAILED) {
+            perror(path);
+            return -1;
+        }
+        printf("%s\n", path);
+        ok = print_stats(base, st.st_size);
+        munmap(base, st.st_size);
+    }
+
+    if (!ok) {
+        fprintf(stderr, "%s: Not a counter file of k2k\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+int
+main(int argc, char *argv[]) {
+    int interval = 0;
+    int opt, i, ret;
+
+    while ((opt = getopt(argc, argv, "i:")) != -1) {
+        switch (opt) {
+        case 'i':
+            interval = atoi(optarg);
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (optind == argc)
+        goto usage;
+
+    for (;;) {
+        ret = EXIT_SUCCESS;
+        for (i = optind; i < argc; ++i)
+            if (print_file(argv[i]) < 0)
+                ret = EXIT_FAILURE;
+        if (interval <= 0)
+            return ret;
+        fflush(stdout);
+        sleep(interval);
+    }
+
+usage:
+    fprintf(stderr, "Usage: %s [-i SECONDS] STATFILE...\n", argv[0]);
+    return EXIT_FAILURE;
+}
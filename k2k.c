@@ -1,7 +1,7 @@
 #define _XOPEN_SOURCE 500
-#ifdef VERBOSE
-# include <stdio.h> /* fprintf() */
-#endif
+#define _GNU_SOURCE /* sched_setaffinity(), syscall(), struct ucred */
+#include <stdio.h> /* fprintf() */
+#include <signal.h> /* sigaction() */
 #include <stdlib.h> /* EXIT_FAILURE */
 #include <errno.h> /* errno */
 #include <unistd.h> /* STD*_FILENO, read() */
@@ -9,6 +9,29 @@
 #include <linux/input.h> /* KEY_*, struct input_event */
 #include <time.h> /* CLOCK_*, clock_gettime() */
 #include <limits.h> /* INT_MAX */
+#include <poll.h> /* poll() */
+#include <stdint.h> /* uint64_t */
+#include <sys/timerfd.h> /* timerfd_*() */
+#include <sys/uio.h> /* writev() */
+#include <fcntl.h> /* open() */
+#include <sys/ioctl.h> /* ioctl() */
+#include <linux/uinput.h> /* UI_*, struct uinput_setup */
+#include <sys/epoll.h> /* epoll_*() */
+#include <sys/socket.h> /* socket(), AF_UNIX */
+#include <sys/un.h> /* struct sockaddr_un */
+#include <sys/mman.h> /* mmap() */
+#include <sys/stat.h> /* fstat() */
+#include <sched.h> /* sched_setscheduler() */
+
+#ifdef IO_URING
+# include <sys/syscall.h> /* __NR_io_uring_*() */
+# include <linux/io_uring.h> /* IORING_*, struct io_uring_* */
+#endif
+#ifdef READER_THREAD
+# include <pthread.h> /* pthread_create() */
+# include <sys/eventfd.h> /* eventfd() */
+#endif
+#include "stats.h"
 
 /* Config {{{1 */
 /* Global config. */
@@ -27,16 +50,41 @@
  * Note that it doesn't introduce any delays, just aims reducing the number of
  * read(2)s and write(2)s.
  * */
-# define MAX_EVENTS 10
+# define MAX_EVENTS 256
+#endif
+
+#ifndef MIN_READ_EVENTS
+/* How many events to read at once while input is calm. It doubles up to
+ * `MAX_EVENTS` while reads come back full. */
+# define MIN_READ_EVENTS 16
+#endif
+
+#ifndef READER_RING_EVENTS
+/* How many events the reader thread (`-DREADER_THREAD`) can hold while output
+ * is stuck. */
+# define READER_RING_EVENTS 4096
 #endif
 
+#ifndef MULTI_MAX_KEYS
+/* How many keys a compiled-in multi rule may have. The cap is intentional:
+ * it only costs memory of `MULTI_RULES`, as the engine and rule files keep
+ * the keys of each rule in a list of its own length. */
+# define MULTI_MAX_KEYS 32
+#endif
+
+#ifndef CONFIG_NAME
+/* Name of the configuration in counters. */
+# define CONFIG_NAME "k2k"
+#endif
+
+#ifndef CHAIN_DRIVER
 /* KEY_* codes: /usr/include/linux/input-event-codes.h */
 
 /** Map a key to another. */
 static struct map_rule {
     int const from_key; /** Map what? */
     int const to_key; /** To what? */
-} MAP_RULES[] = {
+} const MAP_RULES[] = {
 #include "map-rules.h.in"
 };
 
@@ -61,16 +109,12 @@ static struct tap_rule {
                                      without any delays. */
     int const tap_typing: 1; /** Unconditionally act as `tap_key` while typing.
                                (Disables `hold_key` and `repeat_key`.) */
-
-    int was_held: 1;
-    int act_key; /** How `base_key` acts as actually. */
-    /*
-     * Special values:
-     * - `-1`: Waiting.
-     * - `KEY_RESERVED`: Idle.
-     **/
-    int curr_delay; /** Internal counter for `repeat_delay`. */
-} TAP_RULES[] = {
+    int const hold_timeout_ms; /** Act as `repeat_key`, or as `hold_key` if
+                                 there is no `repeat_key` and `action_key`,
+                                 when pressed alone for this long, without
+                                 waiting for `repeat_delay` repeats.
+                                 Optional. */
+} const TAP_RULES[] = {
 #define TAP(key) .base_key = (key), .tap_key = (key)
 #include "tap-rules.h.in"
 #undef TAP
@@ -81,7 +125,7 @@ static struct tap_rule {
  * Take care of `down_press` and `up_press` to be balanced.
  */
 static struct multi_rule {
-    int const keys[8]; /** Keys to watch. */
+    int const keys[MULTI_MAX_KEYS]; /** Keys to watch. */
     int const down_press[2]; /** Press first key and release second key when
                                toggled down. */
     int const up_press[2]; /** Press first key and release second key when
@@ -92,14 +136,12 @@ static struct multi_rule {
                            been down. Negative value means inequality. */
     int const nup; /** Toggle up when this many `keys` are down together.
                      Negative value means inequality. */
-
-    unsigned keys_down; /** Bitmap of down `keys`. */
-    int repeated_key_repeated: 1; /** Did we see `repeated_key` repeating? */
-    int is_down: 1; /** Internal key state. */
-    int can_toggle: 1; /** Whether we can change toggled state. */
-    int repeated_key; /** Which key to override for a repeat action. */
-    int repeating_key; /** The key that we saw last time to repeating. */
-} MULTI_RULES[] = {
+    int const combo_ms; /** Only toggle down when all `keys` are pressed
+                          within this long of the first one, and hold back
+                          their presses meanwhile. Held back keys are
+                          written in order as soon as they cannot be a
+                          chord any more. Optional. */
+} const MULTI_RULES[] = {
 #define KEY_PAIR(key) { KEY_LEFT##key, KEY_RIGHT##key }
 /* Press `key` when toggled down and once again when toggled up. */
 #define PRESS_ON_TOGGLE(key) .down_press = { (key),               (key) }, .up_press = { (key),               (key) }
@@ -155,449 +197,4402 @@ static struct multi_rule {
 #undef PRESS_ON_TOGGLE
 #undef KEY_PAIR
 };
+
+/** Switch layers of remaps, or remap a key on a layer. Keys are looked up on
+ * the layer switched on last only: keys it does not map act as themselves.
+ * Layer switching keys work on every layer. */
+static struct layer_rule {
+    int const layer; /** Layer to switch, or to map `key` on. Any number
+                       above 0 names a layer. */
+    int const key; /** Key that switches `layer`, or that is mapped on it. */
+    int const to_key; /** Act as this key on `layer`. */
+    int const hold; /** Switch `layer` on while `key` is down. */
+    int const toggle; /** Switch `layer` on and off at each press of `key`. */
+    int const tap_key; /** Act as this key when `key` of a `hold` rule is
+                         released without pressing other keys. Optional. */
+} const LAYER_RULES[] = {
+#define LAYER_HOLD(n, k) .layer = (n), .key = (k), .hold = 1
+#define LAYER_TOGGLE(n, k) .layer = (n), .key = (k), .toggle = 1
+#define LAYER_MAP(n, from, to) .layer = (n), .key = (from), .to_key = (to)
+#include "layer-rules.h.in"
+#undef LAYER_MAP
+#undef LAYER_TOGGLE
+#undef LAYER_HOLD
+};
+
+/** Compact form of a tap rule that the engine works with, see
+ * `build_index()`. */
+struct tap_conf {
+    uint16_t base_key, tap_key, hold_key, repeat_key, action_key;
+    /* Rules with the same `base_key` and `tap_key` share being held. */
+    uint16_t first_sibling; /** First of them. */
+    uint16_t next_sibling; /** Next one after this, or `TAP_NO_SIBLING`. */
+    uint16_t tap_mods: 1, hold_immediately: 1, tap_typing: 1;
+    int32_t repeat_delay;
+    int32_t hold_timeout_ms;
+};
+
+#define TAP_NO_SIBLING UINT16_MAX
+
+/** What a tap rule does at the moment. Rules themselves are constant, so that
+ * they can be shared between devices and mapped from a rule file. This part
+ * is touched by every event the rule sees. */
+struct tap_state {
+    int16_t act_key; /** How `base_key` acts as actually. */
+    /*
+     * Special values:
+     * - `-1`: Waiting.
+     * - `KEY_RESERVED`: Idle.
+     **/
+    uint8_t was_held;
+};
+
+/** Rest of the state of a tap rule, touched only while it is waiting. */
+struct tap_cold {
+    int curr_delay; /** Internal counter for `repeat_delay`. */
+    long long hold_deadline; /** When `hold_timeout_ms` elapses. */
+#ifdef LATENCY_STATS
+    long long armed_at; /** When the held back press was read. */
+#endif
+};
+
+/** Compact form of a layer rule that the engine works with. Layers are
+ * numbered from 1 in the order they first appear in rules. */
+struct layer_conf {
+    uint16_t key, to_key, tap_key;
+    uint8_t layer;
+    uint8_t hold: 1, toggle: 1;
+};
+
+/** Compact form of a multi rule that the engine works with, see
+ * `build_index()`. Its keys are `multi_keys[keys_start]` and the `nkeys - 1`
+ * after it, each key once. */
+struct multi_conf {
+    uint16_t keys_start, nkeys;
+    uint16_t down_press[2], up_press[2];
+    int16_t nbeforedown, nbeforeup, nup;
+    int32_t combo_ms;
+};
+
+/** What a multi rule does at the moment. */
+struct multi_state {
+    int ndown; /** Number of down `keys`. */
+    int repeated_key_repeated: 1; /** Did we see `repeated_key` repeating? */
+    int is_down: 1; /** Internal key state. */
+    int can_toggle: 1; /** Whether we can change toggled state. */
+    int combo_open: 1; /** Whether `combo_ms` has not elapsed since the
+                         first of `keys` was pressed. */
+    int repeated_key; /** Which key to override for a repeat action. */
+    int repeating_key; /** The key that we saw last time to repeating. */
+};
+#endif /* CHAIN_DRIVER */
 /* 1}}} */
 
 #define ARRAY_LEN(a) (int)(sizeof(a) / sizeof(*a))
 
-#ifdef VERBOSE
-# define dbgprintf(msg, ...) fprintf(stderr, msg "\n", ##__VA_ARGS__)
+#define LONG_BITS (int)(sizeof(long) * CHAR_BIT)
+#define BITSET_LEN(nbits) (((nbits) + LONG_BITS - 1) / LONG_BITS + 1)
+#define BITSET_SET(set, bit) ((set)[(bit) / LONG_BITS] |= 1UL << ((bit) % LONG_BITS))
+#define BITSET_CLEAR(set, bit) ((set)[(bit) / LONG_BITS] &= ~(1UL << ((bit) % LONG_BITS)))
+#define BITSET_GET(set, bit) (((set)[(bit) / LONG_BITS] >> ((bit) % LONG_BITS)) & 1)
+
+/** Kernel timestamp of an input event in usec. */
+#define EVENT_TIME_USEC(e) ((e).input_event_sec * 1000000LL + (e).input_event_usec)
+
+enum event_values {
+    EVENT_VALUE_KEYUP = 0,
+    EVENT_VALUE_KEYDOWN = 1,
+    EVENT_VALUE_KEYREPEAT = 2,
+};
+
+#ifdef CHAIN_LEN
+/* A fused chain (see `make CHAIN=`) compiles the engine once per stage with
+ * `CHAIN_STAGE` and the I/O driver once with `CHAIN_DRIVER`. Stage `n` is
+ * entered through `chain_stage_event<n>()` and stage `CHAIN_LEN` is the
+ * output. */
+# define CHAIN_CAT_(a, b) a##b
+# define CHAIN_CAT(a, b) CHAIN_CAT_(a, b)
+# define CHAIN_STAGE_EVENT(n) CHAIN_CAT(chain_stage_event, n)
+#endif
+
+#ifdef CHAIN_STAGE
+void CHAIN_STAGE_EVENT(CHAIN_STAGE)(struct input_event const *e);
+void CHAIN_STAGE_EVENT(CHAIN_NEXT)(struct input_event const *e);
+# define output_event CHAIN_STAGE_EVENT(CHAIN_NEXT)
+#endif
+
+#ifdef CHAIN_DRIVER
+void CHAIN_STAGE_EVENT(0)(struct input_event const *e);
+void CHAIN_STAGE_EVENT(CHAIN_LEN)(struct input_event const *e);
+# define process_event(e) CHAIN_STAGE_EVENT(0)(&(e))
+#endif
+
+#ifdef CHAIN_STAGE
+long long CHAIN_CAT(chain_stage_timers, CHAIN_STAGE)(long long now);
+long long CHAIN_CAT(chain_stage_timers, CHAIN_NEXT)(long long now);
+#endif
+
+#ifndef CHAIN_LEN
+__attribute__((unused))
+static long long process_timers(long long now);
+#endif
+
+#ifdef CHAIN_DRIVER
+long long chain_stage_timers0(long long now);
+long long CHAIN_CAT(chain_stage_timers, CHAIN_LEN)(long long now);
+# define process_timers chain_stage_timers0
+#endif
+
+#ifdef CHAIN_STAGE
+void CHAIN_CAT(chain_stage_keys, CHAIN_STAGE)(unsigned long *keys);
+void CHAIN_CAT(chain_stage_keys, CHAIN_NEXT)(unsigned long *keys);
+#endif
+
+#ifndef CHAIN_LEN
+__attribute__((unused))
+static void rule_output_keys(unsigned long *keys);
+#endif
+
+#ifdef CHAIN_DRIVER
+void chain_stage_keys0(unsigned long *keys);
+void CHAIN_CAT(chain_stage_keys, CHAIN_LEN)(unsigned long *keys);
+# define rule_output_keys chain_stage_keys0
+#endif
+
+#ifdef CHAIN_STAGE
+void CHAIN_CAT(chain_stage_stats, CHAIN_STAGE)(char *base, size_t *off);
+void CHAIN_CAT(chain_stage_stats, CHAIN_NEXT)(char *base, size_t *off);
+#endif
+
+#ifndef CHAIN_LEN
+__attribute__((unused))
+static void stats_place(char *base, size_t *off);
+#endif
+
+#ifdef CHAIN_DRIVER
+void chain_stage_stats0(char *base, size_t *off);
+void CHAIN_CAT(chain_stage_stats, CHAIN_LEN)(char *base, size_t *off);
+# define stats_place chain_stage_stats0
+#endif
+
+#ifdef CHAIN_STAGE
+void CHAIN_CAT(chain_stage_prefault, CHAIN_STAGE)(void);
+void CHAIN_CAT(chain_stage_prefault, CHAIN_NEXT)(void);
+#endif
+
+#if !defined BENCH && !defined CHAIN_LEN
+__attribute__((unused))
+static void state_prefault(void);
+#endif
+
+#ifdef CHAIN_DRIVER
+void chain_stage_prefault0(void);
+void CHAIN_CAT(chain_stage_prefault, CHAIN_LEN)(void);
+# define state_prefault chain_stage_prefault0
+#endif
+
+#if !defined BENCH && !defined CHAIN_LEN
+/** Rule file given by `-r`, or `NULL` if rules are compiled in. */
+static char const *rule_path;
+/** Whether `rule_path` has to be mapped again (on `SIGHUP`). */
+static volatile sig_atomic_t reload_pending;
+static void reload_rules(void);
+#endif
+
+/* Variables shared between the I/O driver and chain stages. */
+#if defined CHAIN_STAGE
+# define CHAIN_SHARED extern
+#elif defined CHAIN_DRIVER
+# define CHAIN_SHARED
 #else
-# define dbgprintf(msg, ...) ((void)0)
+# define CHAIN_SHARED static
+#endif
+
+/** Earliest pending timer deadline or 0. Timers run on the clock of input
+ * event timestamps (in nsec), like typing does, so that replayed input
+ * fires them as it did when recorded. */
+CHAIN_SHARED long long timer_deadline;
+/** Whether `timer_deadline` may be earlier than any timer still pending. */
+CHAIN_SHARED int timer_stale;
+
+__attribute__((unused))
+static long long
+monotonic_nsec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+#ifndef BENCH
+/** Fault in the pages of `len` bytes at `p` for writing, without changing
+ * them. */
+__attribute__((unused))
+static void
+prefault(void const *p, size_t len) {
+    uintptr_t const page = sysconf(_SC_PAGESIZE);
+    uintptr_t const start = (uintptr_t)p & ~(page - 1);
+
+    if (p && len)
+        madvise((void *)start, (uintptr_t)p + len - start, MADV_POPULATE_WRITE);
+}
 #endif
 
-#define SEC_TO_NSEC_APPROX  (1LL << 30)
-#define MSEC_TO_NSEC_APPROX (1LL << 20)
-#define TV_TO_NSEC(tv) ((tv).tv_sec * SEC_TO_NSEC_APPROX + (tv).tv_nsec)
+/* Trace of what rules did, always kept in a ring of the last `TRACE_SIZE`
+ * records. Recording a step is a few stores, so tracing is always on. The
+ * ring is printed to stderr on SIGUSR2, and with `-t` it is kept in a file
+ * that `-T` prints while its writer is running. */
+#ifndef TRACE_SIZE
+# define TRACE_SIZE 4096
+#endif
+#define TRACE_MAGIC "k2kT"
+#define TRACE_VERSION 1
+
+/* Steps with their names, and whether they were taken by a rule. */
+#define TRACE_STEPS(STEP) \
+    STEP(INPUT, "input", 0) \
+    STEP(OUTPUT, "output", 0) \
+    STEP(OUTPUT_DROPPED, "output dropped", 0) \
+    STEP(TYPING, "typing", 0) \
+    STEP(MAP, "map", 1) \
+    STEP(TAP_IMMEDIATELY, "tap tapped immediately", 1) \
+    STEP(TAP_ARMED, "tap armed", 1) \
+    STEP(TAP_TAPPED, "tap tapped", 1) \
+    STEP(TAP_TAP_IGNORED, "tap tap ignored", 1) \
+    STEP(TAP_LATE_TAP, "tap late tap", 1) \
+    STEP(TAP_HELD, "tap held", 1) \
+    STEP(TAP_REPEATED, "tap repeated", 1) \
+    STEP(TAP_HOLD_TIMEOUT, "tap hold timeout", 1) \
+    STEP(TAP_ACTION_KEY_UP, "tap action key up", 1) \
+    STEP(TAP_ACTION_KEY_IGNORED, "tap action key ignored", 1) \
+    STEP(TAP_DEARMED, "tap dearmed", 1) \
+    STEP(TAP_UP, "tap up", 1) \
+    STEP(MULTI_REPEATING_KEY, "multi repeating key changed", 1) \
+    STEP(MULTI_TOGGLED, "multi toggled", 1) \
+    STEP(MULTI_REPEATED, "multi repeated", 1) \
+    STEP(MULTI_IGNORED, "multi ignored matched key", 1) \
+    STEP(MULTI_HELD_BACK, "multi held back", 1) \
+    STEP(MULTI_COMBO_MISSED, "multi combo missed", 1) \
+    STEP(LAYER_ON, "layer on", 1) \
+    STEP(LAYER_OFF, "layer off", 1) \
+    STEP(LAYER_MAP, "layer map", 1) \
+    STEP(LAYER_TAPPED, "layer tapped", 1) \
+    STEP(RULES_MAPPED, "rules mapped", 0) \
+    STEP(DEVICE_ADDED, "device added", 0) \
+    STEP(DEVICE_REMOVED, "device removed", 0) \
+    STEP(FORWARDED, "forwarded", 0)
+
+enum trace_step {
+#define STEP(name, str, by_rule) TRACE_##name,
+    TRACE_STEPS(STEP)
+#undef STEP
+    TRACE_NSTEPS,
+};
+
+struct trace_record {
+    int64_t time_usec; /** Time of the input event, or of the step. */
+    uint8_t step; /** `enum trace_step`. */
+    uint8_t stage; /** Chain stage. */
+    uint8_t device; /** Input file descriptor. */
+    uint8_t value; /** Event value, or what a step became. */
+    uint16_t rule;
+    uint16_t code; /** Key of the step, or how many events were forwarded. */
+};
+
+struct trace_ring {
+    char magic[4];
+    uint32_t version;
+    uint32_t size, record_size;
+    /** Records ever written. Records before it are complete; the one at
+     * `head` may be half written. */
+    uint64_t head;
+    struct trace_record records[TRACE_SIZE];
+};
 
-#ifdef CLOCK_MONOTONIC_COARSE
-# define TYPING_CLOCK_SOURCE CLOCK_MONOTONIC_COARSE
+#ifndef CHAIN_STAGE
+static struct trace_ring trace_buf = {
+    .magic = TRACE_MAGIC,
+    .version = TRACE_VERSION,
+    .size = TRACE_SIZE,
+    .record_size = sizeof(struct trace_record),
+};
+CHAIN_SHARED struct trace_ring *trace_ring = &trace_buf;
 #else
-# define TYPING_CLOCK_SOURCE CLOCK_MONOTONIC
+CHAIN_SHARED struct trace_ring *trace_ring;
 #endif
+CHAIN_SHARED unsigned char trace_device;
 
-enum event_values {
-    EVENT_VALUE_KEYUP = 0,
-    EVENT_VALUE_KEYDOWN = 1,
-    EVENT_VALUE_KEYREPEAT = 2,
+#ifdef CHAIN_STAGE
+# define TRACE_STAGE CHAIN_STAGE
+#else
+# define TRACE_STAGE 0
+#endif
+
+/* Record a step of the event being processed. */
+#define TRACE(step, rule, code, value) \
+    trace_add(TRACE_##step, rule, code, value, curr_sec * 1000000LL + curr_usec)
+
+__attribute__((unused))
+static void
+trace_add(int step, int rule, int code, int value, long long time_usec) {
+    struct trace_ring *const t = trace_ring;
+    uint64_t const head = t->head;
+    struct trace_record *const r = &t->records[head % TRACE_SIZE];
+
+    r->time_usec = time_usec;
+    r->step = step;
+    r->stage = TRACE_STAGE;
+    r->device = trace_device;
+    r->value = value;
+    r->rule = rule;
+    r->code = code;
+    __atomic_store_n(&t->head, head + 1, __ATOMIC_RELEASE);
+}
+
+#ifndef CHAIN_STAGE
+__attribute__((unused))
+static long long
+realtime_usec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/** Print records of `t` still in the ring, oldest first. It can be written
+ * meanwhile: records overwritten while taking them are left out. */
+__attribute__((unused))
+static void
+trace_print(FILE *f, struct trace_ring const *t) {
+    static char const *const STEP_NAMES[TRACE_NSTEPS] = {
+#define STEP(name, str, by_rule) [TRACE_##name] = str,
+        TRACE_STEPS(STEP)
+#undef STEP
+    };
+    static unsigned char const STEP_BY_RULE[TRACE_NSTEPS] = {
+#define STEP(name, str, by_rule) [TRACE_##name] = by_rule,
+        TRACE_STEPS(STEP)
+#undef STEP
+    };
+    static struct trace_record records[TRACE_SIZE];
+    uint64_t head, first, now, i;
+
+    head = __atomic_load_n(&t->head, __ATOMIC_ACQUIRE);
+    first = head > TRACE_SIZE ? head - TRACE_SIZE : 0;
+    for (i = first; i < head; ++i)
+        records[i % TRACE_SIZE] = t->records[i % TRACE_SIZE];
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    /* Records up to `now - TRACE_SIZE` may have been overwritten since. */
+    now = __atomic_load_n(&t->head, __ATOMIC_RELAXED);
+    if (now >= TRACE_SIZE && first < now - TRACE_SIZE + 1)
+        first = now - TRACE_SIZE + 1;
+
+    for (i = first; i < head; ++i) {
+        struct trace_record const *const r = &records[i % TRACE_SIZE];
+        long long const usec = r->time_usec;
+
+        fprintf(f, "trace %lld.%06lld stage=%u device=%u %s",
+                usec / 1000000, usec % 1000000, r->stage, r->device,
+                r->step < TRACE_NSTEPS ? STEP_NAMES[r->step] : "?");
+        if (r->step < TRACE_NSTEPS && STEP_BY_RULE[r->step])
+            fprintf(f, " rule=%u", r->rule);
+        fprintf(f, " code=%u value=%u\n", r->code, r->value);
+    }
+}
+#endif
+
+#ifdef LATENCY_STATS
+/* Input-to-output latency histograms.
+ *
+ * Input events are stamped when read and every output event inherits the
+ * stamp of the input it was produced for; tap rules keep the stamp of the
+ * press they held back. Latencies are counted into log2 buckets per path when
+ * the output has been written, and dumped on SIGUSR1 and at exit. */
+enum latency_path {
+    LATENCY_PASSTHROUGH,
+    LATENCY_MAP,
+    LATENCY_TAP,
+    LATENCY_MULTI,
+    LATENCY_NPATHS,
 };
 
+/** Stamp (nsec) and path of the event being passed to the next stage. */
+CHAIN_SHARED long long latency_stamp;
+CHAIN_SHARED unsigned char latency_path;
+
+# define LATENCY_ENTER() (ev_stamp = ev_in_stamp = latency_stamp, ev_path = ev_in_path = latency_path)
+# define LATENCY_RESTORE() (ev_stamp = ev_in_stamp, ev_path = ev_in_path)
+# define LATENCY_PATH(path) (ev_path = (path))
+# define LATENCY_ARM(i) (tap_cold[i].armed_at = ev_stamp)
+# define LATENCY_RESOLVE(i) (ev_stamp = tap_cold[i].armed_at, ev_path = LATENCY_TAP)
+# define LATENCY_OUTPUT() (latency_stamp = ev_stamp, latency_path = ev_path)
+#else
+# define LATENCY_ENTER() ((void)0)
+# define LATENCY_RESTORE() ((void)0)
+# define LATENCY_PATH(path) ((void)0)
+# define LATENCY_ARM(i) ((void)0)
+# define LATENCY_RESOLVE(i) ((void)0)
+# define LATENCY_OUTPUT() ((void)0)
+#endif
+
+#ifndef CHAIN_STAGE
 static struct input_event revbuf[MAX_EVENTS];
 static size_t revlen = 0;
 static size_t riev = 0;
+static size_t revpartial = 0; /** Bytes of an incomplete event after `revlen`. */
+/** Timestamp of the events read last minus `CLOCK_MONOTONIC` time then, in
+ * nsec, to arm timers that are set on input event time. */
+static long long event_clock_offset;
+static size_t revcap = MIN_READ_EVENTS; /** Events to ask for per read. */
+/* Ring of events to write. */
 static struct input_event wevbuf[MAX_EVENTS];
+static size_t wevhead = 0; /** First event to write. */
 static size_t wevlen = 0;
-static int is_typing = 0;
-static struct timespec last_typing;
-static unsigned char matrix[KEY_CNT] = {EVENT_VALUE_KEYUP/*Shitty hack!*/};
-/* HACK: Keycodes assumed to be fit in `unsigned char`. */
-static unsigned char matrix_aliases[KEY_CNT] = {
-    [KEY_LEFTSHIFT]  = KEY_RIGHTSHIFT,
-    [KEY_RIGHTSHIFT] = KEY_LEFTSHIFT,
-    [KEY_LEFTCTRL]   = KEY_RIGHTCTRL,
-    [KEY_RIGHTCTRL]  = KEY_LEFTCTRL,
-    [KEY_LEFTALT]    = KEY_RIGHTALT,
-    [KEY_RIGHTALT]   = KEY_LEFTALT,
-    [KEY_LEFTMETA]   = KEY_RIGHTMETA,
-    [KEY_RIGHTMETA]  = KEY_LEFTMETA,
-};
+static size_t wevframes = 0; /** Events up to the last SYN_REPORT. */
+/** Events after the last SYN_REPORT, including the ones written already. */
+static size_t wevframe_len = 0;
+static size_t wevoff = 0; /** Bytes of `wevbuf[wevhead]` written already. */
+#ifdef LATENCY_STATS
+static long long read_stamp;
+static long long wevstamp[MAX_EVENTS];
+static unsigned char wevpath[MAX_EVENTS];
+static unsigned long latency_hist[LATENCY_NPATHS][64];
+static volatile sig_atomic_t latency_dump_pending;
 
-__attribute__((const))
-static int
-key_ismod(int code) {
-    switch (code) {
-    default:
-        return 0;
-    case KEY_LEFTSHIFT: case KEY_RIGHTSHIFT:
-    case KEY_LEFTCTRL:  case KEY_RIGHTCTRL:
-    case KEY_LEFTALT:   case KEY_RIGHTALT:
-    case KEY_LEFTMETA:  case KEY_RIGHTMETA:
-        return 1;
+/** Count `n` events from `wevhead` as written now. */
+static void
+latency_record(size_t n) {
+    long long const now = monotonic_nsec();
+    size_t i;
+
+    for (i = wevhead; n > 0; --n, i = (i + 1) % MAX_EVENTS) {
+        unsigned long long const nsec = now - wevstamp[i];
+        ++latency_hist[wevpath[i]][63 - __builtin_clzll(nsec | 1)];
     }
 }
 
+/** Print histograms to stderr as `latency PATH le_ns=LIMIT COUNT` lines. */
 static void
-flush_events(void) {
-    if (wevlen == 0)
-        return;
+latency_dump(void) {
+    static char const *const PATH_NAMES[LATENCY_NPATHS] = {
+        [LATENCY_PASSTHROUGH] = "passthrough",
+        [LATENCY_MAP] = "map",
+        [LATENCY_TAP] = "tap",
+        [LATENCY_MULTI] = "multi",
+    };
+    int path, bucket;
 
-    for (;;) {
-        switch (write(STDOUT_FILENO, wevbuf, sizeof *wevbuf * wevlen)) {
-        case -1:
-            if (errno == EINTR)
-                continue;
-            exit(EXIT_FAILURE);
-        default:
-            wevlen = 0;
-            return;
-        }
-    }
+    latency_dump_pending = 0;
+    for (path = 0; path < LATENCY_NPATHS; ++path)
+        for (bucket = 0; bucket < 64; ++bucket)
+            if (latency_hist[path][bucket])
+                fprintf(stderr, "latency %s le_ns=%llu %lu\n",
+                        PATH_NAMES[path], 2ULL << bucket,
+                        latency_hist[path][bucket]);
 }
 
-__attribute__((const))
-static int
-should_check_typing(void) {
-    int i;
-
-    for (i = 0; i < ARRAY_LEN(TAP_RULES); ++i) {
-        struct tap_rule *const v = &TAP_RULES[i];
-        if (v->tap_typing)
-            return 1;
-    }
-    return 0;
+static void
+latency_dump_request(int signum) {
+    (void)signum;
+    latency_dump_pending = 1;
 }
 
 static void
-write_event(struct input_event const *e) {
-    if (e->type == EV_KEY) {
-#if 0
-        dbgprintf("<   Code: %3d Value: %d", e->code, e->value);
+latency_init(void) {
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = latency_dump_request;
+    sigaction(SIGUSR1, &sa, NULL);
+}
 #endif
-        matrix[e->code] = e->value;
-        if (should_check_typing()) {
-            if (!is_typing && e->value == EVENT_VALUE_KEYUP && !key_ismod(e->code)) {
-                is_typing = 1;
-                clock_gettime(TYPING_CLOCK_SOURCE, &last_typing);
-                dbgprintf("Typing: Yes.");
-            }
-        }
-    }
 
-    wevbuf[wevlen++] = *e;
-    if (wevlen == MAX_EVENTS)
-        flush_events();
+#ifndef BENCH
+/* Events are read from `input_fd` and written to `output_fd`. By default
+ * these are stdin and stdout to sit between `intercept -g` and `uinput -d`;
+ * `open_devices()` replaces them with an evdev node and a uinput device. */
+static int input_fd = STDIN_FILENO;
+static int output_fd = STDOUT_FILENO;
+# define input_read(buf, len) read(input_fd, buf, len)
+# define output_writev(iov, iovcnt) writev(output_fd, iov, iovcnt)
+
+# define DEVICE_BITS_LEN(max) ((max) / (CHAR_BIT * sizeof(unsigned long)) + 1)
+# define DEVICE_BIT(bits, i) ((bits)[(i) / (CHAR_BIT * sizeof *(bits))] >> ((i) % (CHAR_BIT * sizeof *(bits))) & 1)
+
+/** Poll the key state of evdev nodes not yet grabbed this often. */
+# define DEVICE_POLL_NSEC 10000000LL
+
+# ifdef DEVICE_STANDINS
+/* For tests: a device is a FIFO of input events, and its output goes to a
+ * file named like it with `.out` appended. */
+
+static int
+device_open(char const *path) {
+    /* Not to wait for, or see the end of, writers. */
+    int const fd = open(path, O_RDWR);
+
+    if (fd < 0)
+        perror(path);
+    return fd;
 }
 
-static void
-read_events(void) {
-    for (;;) {
-        switch ((revlen = read(STDIN_FILENO, revbuf, sizeof revbuf))) {
-        case -1:
-            if (errno == EINTR)
-                continue;
-            /* Fall through. */
-        case 0:
-            exit(EXIT_FAILURE);
-        default:
-            revlen /= sizeof *revbuf, riev = 0;
-            return;
-        }
+static int
+device_keys_up(int in) {
+    (void)in;
+    return 1;
+}
+
+static int
+device_grab(char const *path, int in, int *out_fd) {
+    char out_path[PATH_MAX];
+
+    (void)in;
+    snprintf(out_path, sizeof out_path, "%s.out", path);
+    if ((*out_fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0) {
+        perror(out_path);
+        return -1;
     }
+    return 0;
 }
+# else
+static int
+device_open(char const *path) {
+    int const fd = open(path, O_RDONLY);
 
-static void
-write_key_event(int code, int value) {
-    struct input_event e = {
-        .type = EV_KEY,
-        .code = code,
-        .value = value
-    };
-    write_event(&e);
+    if (fd < 0)
+        perror(path);
+    return fd;
 }
 
+/** Return whether no key of evdev node `in` is down, or -1 after telling
+ * why it cannot be told. */
 static int
-matrix_iskeydown(int code) {
-    return matrix[code] != EVENT_VALUE_KEYUP
-        || matrix[matrix_aliases[code]] != EVENT_VALUE_KEYUP;
+device_keys_up(int in) {
+    unsigned long codes[DEVICE_BITS_LEN(KEY_MAX)] = { 0 };
+    int i;
+
+    if (ioctl(in, EVIOCGKEY(sizeof codes), codes) < 0) {
+        perror("EVIOCGKEY");
+        return -1;
+    }
+    for (i = 0; i < ARRAY_LEN(codes); ++i)
+        if (codes[i])
+            return 0;
+    return 1;
 }
 
-int
-main(void) {
-    for (;;) {
-        int i;
-        struct input_event e;
-        int ignore = 0;
+/** Grab evdev node `in`, opened from `path`, and create a uinput device
+ * that looks like it (and can send any key rules may write) for output.
+ * Return 0 on success, or -1 after telling why not. */
+static int
+device_grab(char const *path, int in, int *out_fd) {
+    static struct {
+        int type, max;
+        unsigned long request;
+    } const CODE_BITS[] = {
+        { EV_KEY, KEY_MAX, UI_SET_KEYBIT },
+        { EV_REL, REL_MAX, UI_SET_RELBIT },
+        { EV_ABS, ABS_MAX, UI_SET_ABSBIT },
+        { EV_MSC, MSC_MAX, UI_SET_MSCBIT },
+        { EV_LED, LED_MAX, UI_SET_LEDBIT },
+        { EV_SND, SND_MAX, UI_SET_SNDBIT },
+        { EV_SW, SW_MAX, UI_SET_SWBIT },
+    };
+    unsigned long types[DEVICE_BITS_LEN(EV_MAX)] = { 0 };
+    unsigned long codes[DEVICE_BITS_LEN(KEY_MAX)];
+    struct uinput_setup setup;
+    int out = -1;
+    char const *what;
+    int i, code;
 
-        /* No more input event to read from the buffer. */
-        if (riev == revlen) {
-            flush_events();
-            read_events();
-        }
-        e = revbuf[riev++];
+    (void)path;
+#define FAIL_IF(cond, name) do { if (cond) { what = (name); goto fail; } } while (0)
 
-        if (e.type != EV_KEY) {
-            /* We don't care about scan codes. */
-            if (e.type == EV_MSC && e.code == MSC_SCAN)
-                goto ignore_event;
-            goto write;
-        }
+    FAIL_IF(ioctl(in, EVIOCGRAB, 1) < 0, "EVIOCGRAB");
 
-#if 0
-        dbgprintf("  > Code: %3d Value: %d", e.code, e.value);
-#endif
+    FAIL_IF((out = open("/dev/uinput", O_WRONLY)) < 0, "/dev/uinput");
 
-        for (i = 0; i < ARRAY_LEN(MAP_RULES); ++i) {
-            struct map_rule *const v = &MAP_RULES[i];
-            if (e.code == v->from_key) {
-                if (v->to_key != KEY_RESERVED) {
-                    dbgprintf("Map rule #%d: %d -> %d.", i, e.code, v->to_key);
-                    e.code = v->to_key;
-                    break;
-                } else {
-                    dbgprintf("Map rule #%d: %d -> (ignore).", i, e.code);
-                    goto ignore_event;
-                }
-            }
-        }
+    FAIL_IF(ioctl(in, EVIOCGBIT(0, sizeof types), types) < 0, "EVIOCGBIT");
+    /* Rules may write keys even if the device has none, e.g. mouse buttons
+     * mapped to keys. */
+    types[EV_KEY / (CHAR_BIT * sizeof *types)] |= 1UL << EV_KEY % (CHAR_BIT * sizeof *types);
+    for (i = 0; i < EV_CNT; ++i)
+        FAIL_IF(DEVICE_BIT(types, i) && i != EV_FF && ioctl(out, UI_SET_EVBIT, i) < 0, "UI_SET_EVBIT");
 
-        /* Check if user is typing. */
-        if (should_check_typing()) {
-            if (is_typing && e.value != EVENT_VALUE_KEYUP) {
-                struct timespec now;
-                clock_gettime(TYPING_CLOCK_SOURCE, &now);
-                time_t const elapsed_msec = (TV_TO_NSEC(now) - TV_TO_NSEC(last_typing)) / MSEC_TO_NSEC_APPROX;
-                memcpy(&last_typing, &now, sizeof last_typing);
-                is_typing = (elapsed_msec <= TYPING_TIMEOUT_MSEC);
-                if (!is_typing)
-                    dbgprintf("Typing: No; elapsed: %ld ms.", elapsed_msec);
-            }
-        }
+    for (i = 0; i < ARRAY_LEN(CODE_BITS); ++i) {
+        int const type = CODE_BITS[i].type;
 
-        for (i = 0; i < ARRAY_LEN(TAP_RULES); ++i) {
-            struct tap_rule *const v = &TAP_RULES[i];
-
-            if (e.code == v->base_key) {
-                switch (e.value) {
-                case EVENT_VALUE_KEYDOWN:
-                    if (v->act_key == KEY_RESERVED) {
-                        v->was_held = 0;
-                        if ((is_typing && v->tap_typing) || matrix_iskeydown(v->hold_key)) {
-                            dbgprintf("Tap rule #%d: Tapped immediately.", i);
-                            v->act_key = v->tap_key;
-                            write_key_event(v->tap_key, EVENT_VALUE_KEYDOWN);
-                        } else {
-                        tap_rearm:
-                            dbgprintf("Tap rule #%d: Armed.", i);
-                            v->act_key = -1;
-                            /* A hold modifier keys can be pressed now and released
-                             * if need to act as tap key in the future. */
-                            if (v->hold_immediately)
-                                write_key_event(v->hold_key, EVENT_VALUE_KEYDOWN);
-                            v->curr_delay = v->repeat_delay;
-                        }
-                    }
-                    ignore = 1;
-                    continue;
-                case EVENT_VALUE_KEYREPEAT:
-                    switch (v->act_key) {
-                    case KEY_RESERVED:
-                        /* Do nothing. */
-                        break;
-                    case -1:
-                        /* Always ignore if we haven't decided what key it
-                         * should be. */
-                        ignore = 1;
-
-                        /* Do not repeat this key. */
-                        if (v->repeat_key == KEY_RESERVED)
-                            continue;
-
-                        /* Wait for more key repeats. */
-                        if (v->curr_delay-- > 0)
-                            continue;
-
-                        /* Timeout reached, act as repeat key. */
-                        dbgprintf("Tap rule #%d: Repeated.", i);
-                        if (v->hold_immediately)
-                            write_key_event(v->hold_key, EVENT_VALUE_KEYUP);
-                        v->act_key = v->repeat_key;
-                        write_key_event(v->act_key, EVENT_VALUE_KEYDOWN);
-                        break;
-                    default:
-                        ignore = 1;
-                        write_key_event(v->act_key, EVENT_VALUE_KEYREPEAT);
-                        break;
-                    }
-                    break;
-                case EVENT_VALUE_KEYUP:
-                    switch (v->act_key) {
-                    case KEY_RESERVED:
-                        /* Do nothing. */
-                        break;
-                    case -1:
-                        /* We've been already hold down with other keys, so we
-                         * mustn't tap now. */
-                        if (!v->was_held) {
-                            int j;
-                            for (j = i; j < ARRAY_LEN(TAP_RULES); ++j) {
-                                struct tap_rule *const w = &TAP_RULES[j];
-                                if (w->base_key == v->base_key
-                                    && w->tap_key == v->tap_key)
-                                    w->was_held = 1;
-                            }
-                            /* We aren't up until now how this key should act. */
-                            dbgprintf("Tap rule #%d: Tapped.", i);
-                            v->act_key = v->tap_key;
-                            if (v->hold_immediately)
-                                write_key_event(v->hold_key, EVENT_VALUE_KEYUP);
-                            write_key_event(v->act_key, EVENT_VALUE_KEYDOWN);
-                        } else {
-                            dbgprintf("Tap rule #%d: Tap ignored.", i);
-                            /* Fall through. */
-                    default:
-                            if (v->action_key != KEY_RESERVED && v->act_key == v->hold_key) {
-                                dbgprintf("Tap rule #%d: Action key up.", i);
-                                write_key_event(v->action_key, EVENT_VALUE_KEYDOWN);
-                            }
-                        }
-
-                        dbgprintf("Tap rule #%d: Up.", i);
-                        ignore = 1;
-                        if (v->act_key != -1)
-                            write_key_event(v->act_key, EVENT_VALUE_KEYUP);
-                        v->act_key = KEY_RESERVED;
-                        break;
-                    }
-                    break;
-                }
-            } else if (v->act_key == -1
-                    && e.value == EVENT_VALUE_KEYDOWN
-                    && (v->action_key == KEY_RESERVED
-                        || (e.code == v->action_key && (!key_ismod(e.code) || !v->tap_mods)))) {
-                if (v->action_key != KEY_RESERVED)
-                    ignore = 1;
-                /* User started typing meanwhile. */
-                if ((is_typing && v->tap_typing) && !v->was_held) {
-                    dbgprintf("Tap rule #%d: Late tap.", i);
-                    v->act_key = v->tap_key;
-                    write_key_event(v->tap_key, EVENT_VALUE_KEYDOWN);
-                } else {
-                    int j;
-                    dbgprintf("Tap rule #%d: Held.", i);
-                    v->act_key = v->hold_key;
-                    /* v->was_held = 1; */
-                    for (j = 0; j < ARRAY_LEN(TAP_RULES); ++j) {
-                        struct tap_rule *const w = &TAP_RULES[j];
-                        if (w->base_key == v->base_key
-                            && w->tap_key == v->tap_key)
-                            w->was_held = 1;
-                    }
-                    /* If `hold_key` was pressed in advance, we don't have to
-                     * press it again. */
-                    if (!v->hold_immediately)
-                        write_key_event(v->act_key, EVENT_VALUE_KEYDOWN);
-                }
-            } else if (v->act_key > 0 && v->action_key != KEY_RESERVED) {
-                if (e.value == EVENT_VALUE_KEYUP) {
-                    dbgprintf("Tap rule #%d: Dearm.", i);
-                    write_key_event(v->act_key, EVENT_VALUE_KEYUP);
-                    goto tap_rearm;
-                } else {
-                    dbgprintf("Tap rule #%d: Action key ignored.", i);
-                    ignore = 1;
-                }
-            }
+        if (!DEVICE_BIT(types, type))
+            continue;
+
+        memset(codes, 0, sizeof codes);
+        FAIL_IF(ioctl(in, EVIOCGBIT(type, sizeof codes), codes) < 0, "EVIOCGBIT");
+        if (type == EV_KEY) {
+            rule_output_keys(codes);
+#ifndef CHAIN_LEN
+            /* Reloaded rules may write any keyboard key. */
+            if (rule_path)
+                for (code = KEY_ESC; code < BTN_MISC; ++code)
+                    BITSET_SET(codes, code);
+#endif
         }
-        if (ignore)
-            goto ignore_event;
-
-        for (i = 0; i < ARRAY_LEN(MULTI_RULES); ++i) {
-            struct multi_rule *const v = &MULTI_RULES[i];
-            int j, ndown = 0, ntotal;
-            int key_matches = 0;
-            int nkeys;
-
-            for (j = 0; j < ARRAY_LEN(v->keys) && v->keys[j] != KEY_RESERVED; ++j) {
-                if (e.code == v->keys[j]) {
-                    key_matches = 1;
-                    if (v->repeated_key == e.code)
-                        v->repeated_key = KEY_RESERVED;
-
-                    switch (e.value) {
-                    case EVENT_VALUE_KEYUP:
-                        v->keys_down &= ~(1 << j);
-                        break;
-                    case EVENT_VALUE_KEYREPEAT:
-                        if (v->repeated_key == KEY_RESERVED || v->repeated_key == e.code) {
-                            v->repeated_key_repeated = 1;
-                            v->repeated_key = e.code;
-                        } else if (!v->repeated_key_repeated && v->repeating_key == e.code) {
-                            v->repeated_key_repeated = 1;
-                            v->repeated_key = e.code;
-                            dbgprintf("Multi rule #%d: Repeating key changed.", i);
-                        } else {
-                            v->repeated_key_repeated = 0;
-                            v->repeating_key = e.code;
-                        }
-                        break;
-                    case EVENT_VALUE_KEYDOWN:
-                        v->keys_down |= 1 << j;
-                        break;
-                    }
-                }
-                ndown += (v->keys_down >> j) & 1;
-            }
-            if (!key_matches)
+
+        for (code = 0; code <= CODE_BITS[i].max; ++code) {
+            if (!DEVICE_BIT(codes, code))
                 continue;
 
-            ntotal = j;
+            FAIL_IF(ioctl(out, CODE_BITS[i].request, code) < 0, "UI_SET_*BIT");
 
-            if (!v->can_toggle) {
-                nkeys = (v->is_down ? v->nbeforeup : v->nbeforedown);
-                v->can_toggle = (nkeys >= 0 ? ndown == nkeys : ndown != -nkeys);
+            if (type == EV_ABS) {
+                struct uinput_abs_setup abs = { .code = code };
+                FAIL_IF(ioctl(in, EVIOCGABS(code), &abs.absinfo) < 0, "EVIOCGABS");
+                FAIL_IF(ioctl(out, UI_ABS_SETUP, &abs) < 0, "UI_ABS_SETUP");
             }
+        }
+    }
 
-            if (v->can_toggle && (!v->is_down
-                        ? ndown == ntotal
-                        : (v->nup >= 0 ? ndown == v->nup : ndown != -v->nup))) {
-                int press[2];
+    memset(codes, 0, sizeof codes);
+    FAIL_IF(ioctl(in, EVIOCGPROP(sizeof codes), codes) < 0, "EVIOCGPROP");
+    for (i = 0; i < INPUT_PROP_CNT; ++i)
+        FAIL_IF(DEVICE_BIT(codes, i) && ioctl(out, UI_SET_PROPBIT, i) < 0, "UI_SET_PROPBIT");
 
-                v->is_down ^= 1;
-                memcpy(press, v->is_down ? v->down_press : v->up_press, sizeof press);
+    memset(&setup, 0, sizeof setup);
+    FAIL_IF(ioctl(in, EVIOCGID, &setup.id) < 0, "EVIOCGID");
+    FAIL_IF(ioctl(in, EVIOCGNAME(sizeof setup.name - 1), setup.name) < 0, "EVIOCGNAME");
+    FAIL_IF(ioctl(out, UI_DEV_SETUP, &setup) < 0, "UI_DEV_SETUP");
+    FAIL_IF(ioctl(out, UI_DEV_CREATE) < 0, "UI_DEV_CREATE");
+#undef FAIL_IF
 
-                nkeys = (v->is_down ? v->nbeforeup : v->nbeforedown);
-                v->can_toggle = (nkeys >= 0 ? ndown == nkeys : ndown != -nkeys);
+    *out_fd = out;
+    return 0;
 
-                dbgprintf("Multi rule #%d: %s now.", i, (v->is_down ? "Down" : "Up"));
+fail:
+    perror(what);
+    if (out >= 0)
+        close(out);
+    return -1;
+}
+# endif
 
-                if (!v->is_down) {
-                    if (press[0] != KEY_RESERVED)
-                        write_key_event(press[0], EVENT_VALUE_KEYDOWN);
+/** Grab evdev node `path` for input and output to a new uinput device that
+ * looks like it, once no key is down on it. Return 0 on success, or -1 after
+ * telling why not. */
+static int
+open_devices(char const *path, int *in_fd, int *out_fd) {
+    int in, up;
+
+    if ((in = device_open(path)) < 0)
+        return -1;
+
+    /* Keys pressed now would be released to us, so others would see them
+     * stuck down. */
+    while (!(up = device_keys_up(in)))
+        usleep(DEVICE_POLL_NSEC / 1000);
+
+    if (up < 0 || device_grab(path, in, out_fd) < 0) {
+        close(in);
+        return -1;
+    }
+    *in_fd = in;
+    return 0;
+}
+#endif
+
+#ifndef BENCH
+static volatile sig_atomic_t trace_dump_pending;
+
+static void
+trace_dump_request(int signum) {
+    (void)signum;
+    trace_dump_pending = 1;
+}
+
+static void
+trace_init(void) {
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = trace_dump_request;
+    sigaction(SIGUSR2, &sa, NULL);
+}
+
+/** Move the trace ring into file `path`, where others can read it. Return 0
+ * on success, or -1 after telling why not. */
+static int
+trace_map(char const *path) {
+    struct trace_ring *t;
+    int fd;
+
+    if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0
+        || ftruncate(fd, sizeof *t) < 0
+        || (t = mmap(NULL, sizeof *t, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        perror(path);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    close(fd);
+
+    /* Also faults every page in now rather than while recording. */
+    memcpy(t, trace_ring, sizeof *t);
+    trace_ring = t;
+    return 0;
+}
+
+/** Counter file given by `-m`, or `NULL`. */
+static char const *stats_path;
+static void *stats_file;
+static size_t stats_file_size;
+
+/** Move counters of every stage into a new file at `stats_path`. Return 0 on
+ * success, or -1 after telling why not. */
+static int
+stats_map_file(void) {
+    struct stats_header const h = {
+        .magic = STATS_MAGIC,
+        .version = STATS_VERSION,
+#ifdef CHAIN_LEN
+        .nstages = CHAIN_LEN,
+#else
+        .nstages = 1,
+#endif
+    };
+    char tmp_path[PATH_MAX];
+    size_t size = sizeof h, off = sizeof h;
+    char *base;
+    int fd;
+
+    stats_place(NULL, &size);
+
+    /* Readers see either the old file or the complete new one. */
+    if (snprintf(tmp_path, sizeof tmp_path, "%s.tmp", stats_path) >= (int)sizeof tmp_path) {
+        fprintf(stderr, "%s: Path too long\n", stats_path);
+        return -1;
+    }
+    if ((fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0
+        || ftruncate(fd, size) < 0
+        || (base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        perror(tmp_path);
+        if (fd >= 0) {
+            close(fd);
+            unlink(tmp_path);
+        }
+        return -1;
+    }
+    close(fd);
+
+    memcpy(base, &h, sizeof h);
+    stats_place(base, &off);
+    if (rename(tmp_path, stats_path) < 0)
+        perror(stats_path);
+
+    if (stats_file)
+        munmap(stats_file, stats_file_size);
+    stats_file = base;
+    stats_file_size = size;
+    return 0;
+}
+
+/** Print the trace ring in file `path` to stdout. Return 0 on success, or
+ * -1 after telling why not. */
+static int
+trace_read(char const *path) {
+    struct trace_ring const *t;
+    struct stat st;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+        perror(path);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    if ((size_t)st.st_size != sizeof *t) {
+        close(fd);
+        goto invalid;
+    }
+    t = mmap(NULL, sizeof *t, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (t == MAP_FAILED) {
+        perror(path);
+        return -1;
+    }
+
+    if (memcmp(t->magic, TRACE_MAGIC, sizeof t->magic)
+        || t->version != TRACE_VERSION
+        || t->size != TRACE_SIZE
+        || t->record_size != sizeof *t->records) {
+        munmap((void *)t, sizeof *t);
+        goto invalid;
+    }
+    trace_print(stdout, t);
+    munmap((void *)t, sizeof *t);
+    return 0;
+
+invalid:
+    fprintf(stderr, "%s: Not a trace of this k2k\n", path);
+    return -1;
+}
+
+/* Real-time mode (`-l`, `-f`, `-a`) keeps k2k responsive on a busy machine:
+ * its memory cannot be paged out, it can run before normal tasks and stay
+ * on a CPU of its own. Each step that is not allowed is told and skipped. */
+
+/** Lock memory, which also faults in what is mapped now or later, and fault
+ * in what events go through in case it cannot be locked: the event buffers,
+ * the trace ring, the state and counters of the engine and the stack. The
+ * io_uring and reader rings are faulted in when they are set up. State
+ * allocated later, for reloaded rules or devices added to a daemon, is only
+ * faulted in if memory is locked. */
+static void
+realtime_lock(void) {
+    volatile char stack[1 << 16];
+    size_t i;
+
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+        perror("Cannot lock memory (mlockall)");
+    prefault(revbuf, sizeof revbuf);
+    prefault(wevbuf, sizeof wevbuf);
+    prefault(trace_ring, sizeof *trace_ring);
+    state_prefault();
+    for (i = 0; i < sizeof stack; i += 4096)
+        stack[i] = 0;
+}
+
+/** Run with SCHED_FIFO priority `priority`, a number. Return 0 on success,
+ * or -1 if it is not a priority of SCHED_FIFO. */
+static int
+realtime_priority(char const *priority) {
+    struct sched_param param;
+    char *end;
+    long const n = strtol(priority, &end, 10);
+
+    if (end == priority || *end
+        || n < sched_get_priority_min(SCHED_FIFO) || n > sched_get_priority_max(SCHED_FIFO))
+        return -1;
+
+    param.sched_priority = n;
+    if (sched_setscheduler(0, SCHED_FIFO, &param) < 0)
+        perror("Cannot use SCHED_FIFO");
+    return 0;
+}
+
+/** Run on the CPUs in list `cpus`, e.g. `2` or `0,2-3`. Return 0 on
+ * success, or -1 if the list cannot be parsed. */
+static int
+realtime_affinity(char const *cpus) {
+    cpu_set_t set;
+    char *end;
+
+    CPU_ZERO(&set);
+    for (;;) {
+        long first = strtol(cpus, &end, 10), last = first;
+
+        if (end == cpus || first < 0)
+            return -1;
+        if (*end == '-') {
+            cpus = end + 1;
+            last = strtol(cpus, &end, 10);
+            if (end == cpus || last < first)
+                return -1;
+        }
+        for (; first <= last && first < CPU_SETSIZE; ++first)
+            CPU_SET(first, &set);
+        if (!*end)
+            break;
+        if (*end != ',')
+            return -1;
+        cpus = end + 1;
+    }
+
+    if (sched_setaffinity(0, sizeof set, &set) < 0)
+        perror("Cannot set CPU affinity");
+    return 0;
+}
+
+/* With `-j` the time from the timestamp of each input event until output
+ * for its batch has been written is kept in a histogram, and reported on
+ * SIGUSR1 and at exit. This includes waking up and anything before k2k in
+ * the pipeline. Buckets are 1/8 of a power of two microseconds wide. */
+#define JITTER_BUCKETS (8 * 62)
+
+static int jitter_on;
+static unsigned long jitter_hist[JITTER_BUCKETS];
+static long long jitter_max;
+static volatile sig_atomic_t jitter_dump_pending;
+
+static int
+jitter_bucket(long long usec) {
+    int e;
+
+    if (usec < 8)
+        return usec;
+    e = 63 - __builtin_clzll(usec);
+    return (e - 2) * 8 + (usec >> (e - 3) & 7);
+}
+
+/** Largest value of `bucket`. */
+static long long
+jitter_bucket_max(int bucket) {
+    int const e = bucket / 8 + 2;
+
+    if (bucket < 8)
+        return bucket;
+    return ((8LL + bucket % 8 + 1) << (e - 3)) - 1;
+}
+
+/** Count the events in `revbuf` as written now. */
+static void
+jitter_record(void) {
+    struct timespec ts;
+    long long now;
+    size_t i;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    now = ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+    for (i = 0; i < revlen; ++i) {
+        long long usec = now - EVENT_TIME_USEC(revbuf[i]);
+
+        if (usec < 0)
+            usec = 0;
+        if (usec > jitter_max)
+            jitter_max = usec;
+        ++jitter_hist[jitter_bucket(usec)];
+    }
+}
+
+static void
+jitter_dump(void) {
+    static int const PERMILLE[] = { 500, 900, 990, 999 };
+    unsigned long n = 0, seen = 0;
+    int bucket, i = 0;
+
+    jitter_dump_pending = 0;
+    for (bucket = 0; bucket < JITTER_BUCKETS; ++bucket)
+        n += jitter_hist[bucket];
+    fprintf(stderr, "jitter events %lu", n);
+    for (bucket = 0; bucket < JITTER_BUCKETS && i < ARRAY_LEN(PERMILLE); ++bucket) {
+        seen += jitter_hist[bucket];
+        for (; i < ARRAY_LEN(PERMILLE) && seen * 1000 >= n * PERMILLE[i] && n; ++i)
+            fprintf(stderr, " p%d_us %lld", PERMILLE[i] / (PERMILLE[i] % 10 ? 1 : 10),
+                    jitter_bucket_max(bucket) < jitter_max ? jitter_bucket_max(bucket) : jitter_max);
+    }
+    fprintf(stderr, " max_us %lld\n", jitter_max);
+}
+
+static void
+jitter_dump_request(int signum) {
+    (void)signum;
+    jitter_dump_pending = 1;
+#ifdef LATENCY_STATS
+    latency_dump_pending = 1;
+#endif
+}
+
+static void
+jitter_init(void) {
+    struct sigaction sa;
+
+    jitter_on = 1;
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = jitter_dump_request;
+    sigaction(SIGUSR1, &sa, NULL);
+}
+#endif
+
+/** Act on signals that interrupted a blocking call. */
+static void
+handle_signals(void) {
+#ifdef LATENCY_STATS
+    if (latency_dump_pending)
+        latency_dump();
+#endif
+#ifndef BENCH
+    if (trace_dump_pending) {
+        trace_dump_pending = 0;
+        trace_print(stderr, trace_ring);
+    }
+    if (jitter_dump_pending)
+        jitter_dump();
+#endif
+}
+
+/** Fill `iov` with the first `n` buffered events. Return the number of
+ * `iov` entries used. */
+static int
+wevbuf_iov(struct iovec iov[2], size_t n) {
+    size_t const nfirst = MAX_EVENTS - wevhead < n ? MAX_EVENTS - wevhead : n;
+
+    iov[0].iov_base = (char *)&wevbuf[wevhead] + wevoff;
+    iov[0].iov_len = nfirst * sizeof *wevbuf - wevoff;
+    /* The ring wrapped around. */
+    iov[1].iov_base = wevbuf;
+    iov[1].iov_len = (n - nfirst) * sizeof *wevbuf;
+    return 1 + (nfirst < n);
+}
+
+/** Count `len` bytes from `wevbuf[wevhead]` as written. */
+static void
+wevbuf_written(size_t len) {
+    size_t nwritten;
+
+    /* A short write may end inside an event. */
+    len += wevoff;
+    nwritten = len / sizeof *wevbuf;
+    wevoff = len % sizeof *wevbuf;
+#ifdef LATENCY_STATS
+    latency_record(nwritten);
+#endif
+    wevhead = (wevhead + nwritten) % MAX_EVENTS;
+    wevlen -= nwritten;
+    wevframes = wevframes > nwritten ? wevframes - nwritten : 0;
+}
+
+/** Move the beginning of an event that was cut in half last time to the
+ * front of `revbuf`, before reading more after it. */
+static void
+revbuf_rewind(void) {
+    memmove(revbuf, &revbuf[revlen], revpartial);
+    revlen = 0, riev = 0;
+}
+
+/** Count `len` bytes read after `revpartial`. */
+static void
+revbuf_read(size_t len) {
+#ifdef LATENCY_STATS
+    read_stamp = monotonic_nsec();
+#endif
+    revlen = (revpartial + len) / sizeof *revbuf;
+    revpartial = (revpartial + len) % sizeof *revbuf;
+    if (revlen > 0)
+        event_clock_offset = EVENT_TIME_USEC(revbuf[revlen - 1]) * 1000 - monotonic_nsec();
+
+    /* Read more at once while input is bursty. */
+    if (revlen == revcap && revcap < MAX_EVENTS)
+        revcap = 2 * revcap < MAX_EVENTS ? 2 * revcap : MAX_EVENTS;
+    else if (revlen < revcap / 4 && revcap > MIN_READ_EVENTS)
+        revcap /= 2;
+}
+
+/* Recordings (see `-R`) keep input as it was read, one batch per read with
+ * the time since the read before, so that it can be replayed through the
+ * engine (see `-p`) or by bench. A recording is a `struct record_header`
+ * followed by batches, each a `struct record_batch` and its events padded to
+ * 8 bytes. It ends with a batch of no events or at the end of the file. */
+#define RECORD_MAGIC "k2kI"
+#define RECORD_VERSION 1
+
+struct record_header {
+    char magic[4];
+    uint32_t version;
+};
+
+struct record_batch {
+    uint32_t nevents;
+    uint32_t delay_usec; /** Since the batch before was read. */
+    int64_t time_usec; /** Timestamp of the first event. */
+};
+
+struct record_event {
+    int32_t dtime_usec; /** Timestamp after `time_usec` of the batch. */
+    uint16_t type, code;
+    int32_t value;
+};
+
+#define RECORD_BATCH_SIZE(nevents) \
+    (sizeof(struct record_batch) + ((nevents) * sizeof(struct record_event) + 7) / 8 * 8)
+
+/** Return the offset of the first batch of recording `base` of `size`
+ * bytes, or 0 if it is not a recording. */
+static size_t
+record_start(char const *base, size_t size) {
+    struct record_header const *const h = (void const *)base;
+
+    if (size < sizeof *h
+        || memcmp(h->magic, RECORD_MAGIC, sizeof h->magic)
+        || h->version != RECORD_VERSION)
+        return 0;
+    return sizeof *h;
+}
+
+/** Return the batch at `*off` of recording `base` of `size` bytes and move
+ * `*off` past it, or `NULL` at the end. */
+static struct record_batch const *
+record_next(char const *base, size_t size, size_t *off) {
+    struct record_batch const *const b = (void const *)(base + *off);
+
+    if (size - *off < sizeof *b
+        || !b->nevents
+        || size - *off < RECORD_BATCH_SIZE(b->nevents))
+        return NULL;
+    *off += RECORD_BATCH_SIZE(b->nevents);
+    return b;
+}
+
+/** Decode `n` events of batch `b` from `first` into `events`. */
+static void
+record_events(struct record_batch const *b, size_t first, size_t n, struct input_event *events) {
+    struct record_event const *const r = (void const *)(b + 1);
+    size_t i;
+
+    for (i = 0; i < n; ++i) {
+        long long const time = b->time_usec + r[first + i].dtime_usec;
+
+        events[i].input_event_sec = time / 1000000;
+        events[i].input_event_usec = time % 1000000;
+        events[i].type = r[first + i].type;
+        events[i].code = r[first + i].code;
+        events[i].value = r[first + i].value;
+    }
+}
+
+#ifndef BENCH
+#ifndef RECORD_WINDOW
+/* How much of a recording is mapped for appending at once. */
+# define RECORD_WINDOW (1 << 20)
+#endif
+
+/* The recorder only appends to the mapped file, so batches are in the file
+ * as soon as they are recorded, even if k2k is killed. Readers see a batch
+ * once its `nevents` is set. */
+static struct {
+    int fd; /** -1 unless recording. */
+    char *map; /** `RECORD_WINDOW` bytes of the file from `map_off`. */
+    off_t map_off;
+    off_t end; /** Where the next batch goes. */
+    long long read_nsec; /** When the events in `revbuf` were read. */
+    long long last_nsec; /** When the batch before was read. */
+} record = { .fd = -1 };
+
+/** Map the window of the recording that `record.end` is in, growing the
+ * file. Return 0 on success, or -1 with `errno` set. */
+static int
+record_map(void) {
+    off_t const off = record.end & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+    char *map;
+
+    if (ftruncate(record.fd, off + RECORD_WINDOW) < 0
+        || (map = mmap(NULL, RECORD_WINDOW, PROT_READ | PROT_WRITE, MAP_SHARED, record.fd, off)) == MAP_FAILED)
+        return -1;
+    if (record.map)
+        munmap(record.map, RECORD_WINDOW);
+    record.map = map;
+    record.map_off = off;
+    return 0;
+}
+
+/** Start recording input to a new file at `path`. Return 0 on success, or
+ * -1 after telling why not. */
+static int
+record_open(char const *path) {
+    struct record_header const h = {
+        .magic = RECORD_MAGIC,
+        .version = RECORD_VERSION,
+    };
+
+    if ((record.fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0
+        || record_map() < 0) {
+        perror(path);
+        if (record.fd >= 0)
+            close(record.fd);
+        record.fd = -1;
+        return -1;
+    }
+    memcpy(record.map, &h, sizeof h);
+    record.end = sizeof h;
+    return 0;
+}
+
+/** Append the events in `revbuf` to the recording. A batch whose timestamps
+ * are too far apart is split. */
+static void
+record_batch(void) {
+    long long delay_usec = record.last_nsec ? (record.read_nsec - record.last_nsec) / 1000 : 0;
+    size_t i = 0;
+
+    record.last_nsec = record.read_nsec;
+    while (i < revlen) {
+        struct record_batch *b;
+        struct record_event *r;
+        uint32_t n;
+
+        if (record.end + (off_t)RECORD_BATCH_SIZE(revlen - i) > record.map_off + RECORD_WINDOW
+            && record_map() < 0) {
+            perror("Recording stopped");
+            close(record.fd);
+            record.fd = -1;
+            return;
+        }
+
+        b = (void *)(record.map + (record.end - record.map_off));
+        r = (void *)(b + 1);
+        b->delay_usec = delay_usec < UINT32_MAX ? delay_usec : UINT32_MAX;
+        b->time_usec = EVENT_TIME_USEC(revbuf[i]);
+        for (n = 0; i < revlen; ++n, ++i) {
+            long long const dtime = EVENT_TIME_USEC(revbuf[i]) - b->time_usec;
+
+            if (dtime < INT32_MIN || dtime > INT32_MAX)
+                break;
+            r[n].dtime_usec = dtime;
+            r[n].type = revbuf[i].type;
+            r[n].code = revbuf[i].code;
+            r[n].value = revbuf[i].value;
+        }
+        __atomic_store_n(&b->nevents, n, __ATOMIC_RELEASE);
+        record.end += RECORD_BATCH_SIZE(n);
+        delay_usec = 0;
+    }
+}
+
+/** Cut the recording after its last batch. */
+static void
+record_close(void) {
+    if (record.fd < 0)
+        return;
+    if (ftruncate(record.fd, record.end) < 0)
+        perror("Recording");
+    close(record.fd);
+    record.fd = -1;
+}
+#endif
+
+#if defined IO_URING && !defined BENCH && !defined READER_THREAD
+/* With `-DIO_URING` events go through an io_uring when the kernel lets us
+ * set one up. A read of `input_fd` stays posted while waiting, and buffered
+ * events are written by the same io_uring_enter(2) that waits for the next
+ * read, so a batch takes one system call instead of a read(2) and a
+ * writev(2). `revbuf` and `wevbuf` are registered with the kernel if it
+ * allows. Without a ring, events are read and written as usual. */
+# define URING
+
+static void write_events(size_t n);
+
+/** What a submission is for, in the low bits of its `user_data`. */
+enum {
+    URING_READ,
+    URING_WRITE,
+    URING_TIMEOUT, /** `user_data >> 2` tells which one. */
+    URING_TIMEOUT_REMOVE,
+};
+
+static struct {
+    int fd; /** -1 without a ring. */
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe const *cqes;
+    unsigned nqueued; /** Submissions to make at the next enter. */
+    int fixed; /** Whether `revbuf` and `wevbuf` are registered. */
+    int reading; /** Whether a read is posted. */
+    int read_done;
+    int read_res;
+    size_t writing; /** Events from `wevhead` being written. */
+    struct iovec iov[2]; /** Of the write, unless it is fixed. */
+    long long timeout; /** Deadline of the posted timeout, or 0. */
+    unsigned timeout_seq;
+    int timeout_fired;
+    struct __kernel_timespec ts;
+} uring = { .fd = -1 };
+
+/** Set up a ring for `input_fd` and `output_fd`. Keep using read(2) and
+ * writev(2) if that is not possible. */
+static void
+uring_init(void) {
+    struct io_uring_params p;
+    struct iovec const bufs[2] = {
+        { revbuf, sizeof revbuf },
+        { wevbuf, sizeof wevbuf },
+    };
+    size_t sq_size, cq_size;
+    char *sq, *cq;
+    int fd;
+
+    memset(&p, 0, sizeof p);
+    if ((fd = syscall(__NR_io_uring_setup, 8, &p)) < 0)
+        return;
+    /* Reads and writes at the current position need Linux 5.6. */
+    if ((p.features & (IORING_FEAT_SINGLE_MMAP | IORING_FEAT_RW_CUR_POS))
+        != (IORING_FEAT_SINGLE_MMAP | IORING_FEAT_RW_CUR_POS))
+        goto fail;
+
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (sq_size < cq_size)
+        sq_size = cq_size;
+    sq = cq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED)
+        goto fail;
+    uring.sqes = mmap(NULL, p.sq_entries * sizeof *uring.sqes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (uring.sqes == MAP_FAILED) {
+        munmap(sq, sq_size);
+        goto fail;
+    }
+
+    uring.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    uring.sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    uring.sq_array = (unsigned *)(sq + p.sq_off.array);
+    uring.cq_head = (unsigned *)(cq + p.cq_off.head);
+    uring.cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    uring.cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    uring.cqes = (struct io_uring_cqe const *)(cq + p.cq_off.cqes);
+    /* Registered buffers are pinned, which may exceed RLIMIT_MEMLOCK. */
+    uring.fixed = !syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, bufs, 2);
+    uring.fd = fd;
+    return;
+
+fail:
+    close(fd);
+}
+
+/** Return a cleared submission to be made at the next enter. */
+static struct io_uring_sqe *
+uring_sqe(void) {
+    unsigned const i = (*uring.sq_tail + uring.nqueued++) & *uring.sq_mask;
+    struct io_uring_sqe *const sqe = &uring.sqes[i];
+
+    memset(sqe, 0, sizeof *sqe);
+    uring.sq_array[i] = i;
+    return sqe;
+}
+
+/** Make queued submissions and wait until `nwait` completions arrive, or a
+ * signal. */
+static void
+uring_enter(unsigned nwait) {
+    unsigned const n = uring.nqueued;
+
+    __atomic_store_n(uring.sq_tail, *uring.sq_tail + n, __ATOMIC_RELEASE);
+    uring.nqueued = 0;
+    if (syscall(__NR_io_uring_enter, uring.fd, n, nwait, nwait ? IORING_ENTER_GETEVENTS : 0, NULL, 0) < 0
+        && errno != EINTR)
+        exit(EXIT_FAILURE);
+}
+
+/** Take completions. */
+static void
+uring_reap(void) {
+    unsigned head;
+
+    /* Handlers may reap too. */
+    while ((head = *uring.cq_head) != __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe const cqe = uring.cqes[head & *uring.cq_mask];
+
+        __atomic_store_n(uring.cq_head, head + 1, __ATOMIC_RELEASE);
+        switch (cqe.user_data & 3) {
+        case URING_READ:
+            uring.reading = 0;
+            uring.read_done = 1;
+            uring.read_res = cqe.res;
+            break;
+
+        case URING_WRITE:
+        {
+            size_t const n = uring.writing, wevlen_was = wevlen;
+
+            if (cqe.res < 0)
+                exit(EXIT_FAILURE);
+            uring.writing = 0;
+            wevbuf_written(cqe.res);
+            /* Output is backed up; wait for it as write(2) would. */
+            write_events(n - (wevlen_was - wevlen));
+            break;
+        }
+
+        case URING_TIMEOUT:
+            /* Removed timeouts complete too. */
+            if (cqe.user_data >> 2 == uring.timeout_seq) {
+                uring.timeout = 0;
+                uring.timeout_fired = 1;
+            }
+            break;
+        }
+    }
+}
+
+/** Wait until the posted write (if any) completes. */
+static void
+uring_wait_write(void) {
+    if (uring.fd < 0)
+        return;
+    for (uring_reap(); uring.writing; uring_reap()) {
+        uring_enter(1);
+        handle_signals();
+    }
+}
+
+/** Post a write of every buffered event. It is made at the next enter. */
+static void
+uring_write(void) {
+    struct io_uring_sqe *sqe;
+    int iovcnt;
+
+    uring_wait_write();
+    if (!wevlen)
+        return;
+
+    sqe = uring_sqe();
+    iovcnt = wevbuf_iov(uring.iov, wevlen);
+    if (uring.fixed && iovcnt == 1) {
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->addr = (uintptr_t)uring.iov[0].iov_base;
+        sqe->len = uring.iov[0].iov_len;
+        sqe->buf_index = 1;
+    } else {
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->addr = (uintptr_t)uring.iov;
+        sqe->len = iovcnt;
+    }
+    sqe->fd = output_fd;
+    sqe->off = -1;
+    sqe->user_data = URING_WRITE;
+    uring.writing = wevlen;
+}
+
+/** Read into `revbuf` through the ring while firing timers. Return what
+ * read(2) would, as if interrupted by a signal if there is no input yet. */
+static ssize_t
+uring_fill_events(void) {
+    struct io_uring_sqe *sqe;
+
+    if (!uring.reading) {
+        revbuf_rewind();
+        sqe = uring_sqe();
+        sqe->opcode = uring.fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+        sqe->fd = input_fd;
+        sqe->off = -1;
+        sqe->addr = (uintptr_t)((char *)revbuf + revpartial);
+        sqe->len = revcap * sizeof *revbuf - revpartial;
+        sqe->user_data = URING_READ;
+        uring.reading = 1;
+    }
+
+    if (uring.timeout != timer_deadline) {
+        if (uring.timeout) {
+            sqe = uring_sqe();
+            sqe->opcode = IORING_OP_TIMEOUT_REMOVE;
+            sqe->fd = -1;
+            sqe->addr = (uint64_t)uring.timeout_seq << 2 | URING_TIMEOUT;
+            sqe->user_data = URING_TIMEOUT_REMOVE;
+        }
+        ++uring.timeout_seq;
+        if ((uring.timeout = timer_deadline)) {
+            long long const deadline = timer_deadline - event_clock_offset;
+            uring.ts.tv_sec = deadline / 1000000000LL;
+            uring.ts.tv_nsec = deadline % 1000000000LL;
+            sqe = uring_sqe();
+            sqe->opcode = IORING_OP_TIMEOUT;
+            sqe->fd = -1;
+            sqe->addr = (uintptr_t)&uring.ts;
+            sqe->len = 1;
+            sqe->timeout_flags = IORING_TIMEOUT_ABS;
+            sqe->user_data = (uint64_t)uring.timeout_seq << 2 | URING_TIMEOUT;
+        }
+    }
+
+    /* A write made now completes at once, unless output is stuck. Signals
+     * do not fail an enter that made submissions, so it may return early
+     * without telling. */
+    uring_enter(1 + !!uring.writing);
+    uring_reap();
+
+    if (uring.timeout_fired) {
+        uring.timeout_fired = 0;
+        timer_deadline = process_timers(monotonic_nsec() + event_clock_offset);
+        uring_write();
+    }
+
+    if (!uring.read_done) {
+        errno = EINTR;
+        return -1;
+    }
+    uring.read_done = 0;
+    if (uring.read_res < 0) {
+        errno = -uring.read_res;
+        return -1;
+    }
+    if (uring.read_res > 0)
+        revbuf_read(uring.read_res);
+    return uring.read_res;
+}
+#endif
+
+/** Write the first `n` buffered events. */
+static void
+write_events(size_t n) {
+#ifdef URING
+    /* Keep output in order. */
+    uring_wait_write();
+#endif
+    while (n > 0) {
+        struct iovec iov[2];
+        int const iovcnt = wevbuf_iov(iov, n);
+        size_t const wevlen_was = wevlen;
+        ssize_t len;
+
+        if ((len = output_writev(iov, iovcnt)) < 0) {
+            if (errno == EINTR) {
+                handle_signals();
+                continue;
+            }
+            exit(EXIT_FAILURE);
+        }
+
+        wevbuf_written(len);
+        n -= wevlen_was - wevlen;
+    }
+}
+
+static void
+flush_events(void) {
+#ifdef URING
+    if (uring.fd >= 0) {
+        uring_write();
+        return;
+    }
+#endif
+    write_events(wevlen);
+}
+
+/** Return whether `e` belongs to the canonical output: every frame ends in
+ * exactly one SYN_REPORT. Key events are canonical already, as
+ * `write_event()` checks them against `matrix`. */
+static int
+canon_event(struct input_event const *e) {
+    if (e->type == EV_SYN && e->code == SYN_REPORT) {
+        if (!wevframe_len)
+            return 0;
+        wevframe_len = 0;
+        return 1;
+    }
+
+    ++wevframe_len;
+    return 1;
+}
+
+static void
+output_event(struct input_event const *e) {
+    size_t const i = (wevhead + wevlen) % MAX_EVENTS;
+
+    if (!canon_event(e))
+        return;
+
+#ifdef LATENCY_STATS
+    wevstamp[i] = latency_stamp;
+    wevpath[i] = latency_path;
+#endif
+    wevbuf[i] = *e;
+    ++wevlen;
+    if (e->type == EV_SYN && e->code == SYN_REPORT)
+        wevframes = wevlen;
+
+    /* Make room by writing complete frames, so that readers on the other
+     * side do not see a frame split, unless one frame fills the buffer. */
+    if (wevlen == MAX_EVENTS)
+        write_events(wevframes ? wevframes : wevlen);
+}
+
+#ifndef BENCH
+/** Wait for input on `fd` while firing timers. Return whether input is
+ * ready. */
+static int
+wait_input(int fd) {
+    static int timer_fd = -1;
+    static long long armed_deadline;
+    struct pollfd fds[2];
+
+    if (timer_fd < 0
+        && (timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+        exit(EXIT_FAILURE);
+
+    if (armed_deadline != timer_deadline) {
+        long long const deadline = timer_deadline ? timer_deadline - event_clock_offset : 0;
+        struct itimerspec const its = {
+            .it_value = {
+                .tv_sec = deadline / 1000000000LL,
+                .tv_nsec = deadline % 1000000000LL,
+            },
+        };
+        timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+        armed_deadline = timer_deadline;
+    }
+
+    fds[0].fd = fd, fds[0].events = POLLIN;
+    fds[1].fd = timer_fd, fds[1].events = POLLIN;
+    if (poll(fds, 2, -1) < 0) {
+        if (errno != EINTR)
+            exit(EXIT_FAILURE);
+        handle_signals();
+        return 0;
+    }
+
+    if (fds[1].revents & POLLIN) {
+        uint64_t nexpirations;
+        if (read(timer_fd, &nexpirations, sizeof nexpirations) < 0 && errno != EAGAIN)
+            exit(EXIT_FAILURE);
+        /* Input read since it was armed may have moved the deadline on
+         * the monotonic clock, so it is armed again even if not fired. */
+        armed_deadline = 0;
+        timer_deadline = process_timers(monotonic_nsec() + event_clock_offset);
+        flush_events();
+    }
+
+    return fds[0].revents != 0;
+}
+#endif
+
+/** Read once into `revbuf`. Return what read(2) returned. */
+static ssize_t
+fill_events(void) {
+    ssize_t len;
+
+    revbuf_rewind();
+    len = input_read((char *)revbuf + revpartial, revcap * sizeof *revbuf - revpartial);
+    if (len > 0)
+        revbuf_read(len);
+    return len;
+}
+
+#ifndef BENCH
+/* Replaying (`-p` and `-P`) takes input from a recording instead of
+ * `input_fd`, either with the delays between reads as they were recorded or
+ * as fast as possible. */
+static struct {
+    char const *map; /** `NULL` unless replaying. */
+    size_t size;
+    size_t off; /** Of the next batch. */
+    struct record_batch const *batch;
+    size_t nread; /** Events of `batch` taken. */
+    int fast; /** Whether to skip delays. */
+    long long due; /** When the batch is due. */
+} replay;
+
+/** Start replaying recording `path`, as fast as possible if `fast`. Return 0
+ * on success, or -1 after telling why not. */
+static int
+replay_open(char const *path, int fast) {
+    struct stat st;
+    void *map;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+        perror(path);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    map = st.st_size ? mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED || !(replay.off = record_start(map, st.st_size))) {
+        fprintf(stderr, "%s: Not a recording of k2k\n", path);
+        if (map != MAP_FAILED)
+            munmap(map, st.st_size);
+        return -1;
+    }
+
+    replay.map = map;
+    replay.size = st.st_size;
+    replay.fast = fast;
+    replay.due = monotonic_nsec();
+    return 0;
+}
+
+/** Take the next batch of the recording into `revbuf`, waiting for it while
+ * firing timers. Return what read(2) would. */
+static ssize_t
+replay_fill_events(void) {
+    size_t n;
+
+    if (!replay.batch || replay.nread == replay.batch->nevents) {
+        if (!(replay.batch = record_next(replay.map, replay.size, &replay.off)))
+            return 0;
+        replay.nread = 0;
+        replay.due += replay.batch->delay_usec * 1000LL;
+    }
+
+    while (!replay.fast) {
+        long long const now = monotonic_nsec();
+        long long const timer = timer_deadline - event_clock_offset;
+        long long const until = timer_deadline && timer < replay.due ? timer : replay.due;
+        struct timespec ts;
+
+        if (until <= now) {
+            if (until == replay.due)
+                break;
+            timer_deadline = process_timers(now + event_clock_offset);
+            flush_events();
+            continue;
+        }
+        ts.tv_sec = (until - now) / 1000000000LL;
+        ts.tv_nsec = (until - now) % 1000000000LL;
+        if (nanosleep(&ts, NULL) < 0)
+            return -1;
+    }
+
+    /* Batches of other builds may be larger. */
+    n = replay.batch->nevents - replay.nread;
+    if (n > MAX_EVENTS)
+        n = MAX_EVENTS;
+    revbuf_rewind();
+    record_events(replay.batch, replay.nread, n, revbuf);
+    replay.nread += n;
+    revbuf_read(n * sizeof *revbuf);
+    return n * sizeof *revbuf;
+}
+#endif
+
+#if defined READER_THREAD && !defined BENCH
+/* With `-DREADER_THREAD` a thread reads input into a ring as soon as it
+ * arrives, and the engine takes events from there. So input is drained even
+ * while the engine waits for output, which would otherwise leave events in
+ * the kernel until its buffer overflows and drops them. The ring is a single
+ * producer, single consumer queue: each side only writes its own position. */
+# define READER
+
+static struct {
+    struct input_event ring[READER_RING_EVENTS];
+    int wake_fd; /** -1 without a reader thread. */
+    int room_fd; /** Wakes the reader thread when the ring was full. */
+    /* Written by the reader thread. */
+    size_t tail __attribute__((aligned(64))); /** Events read. */
+    int done; /** -1 while reading, then 0 at end of input or `errno`. */
+    int waiting; /** Whether the reader waits for `room_fd`. */
+    unsigned high; /** Most events the ring held at once. */
+    unsigned full; /** How many times the ring filled up. */
+    /* Written by the engine. */
+    size_t head __attribute__((aligned(64))); /** Events taken. */
+    int sleeping; /** Whether the engine waits for `wake_fd`. */
+} reader = { .wake_fd = -1, .room_fd = -1, .done = -1 };
+
+/** Tell the engine that there is news if it waits for it. */
+static void
+reader_wake(void) {
+    uint64_t const one = 1;
+
+    if (__atomic_load_n(&reader.sleeping, __ATOMIC_SEQ_CST)
+        && write(reader.wake_fd, &one, sizeof one) < 0)
+        exit(EXIT_FAILURE);
+}
+
+/** Read `input_fd` into the ring until end of input. */
+static void *
+reader_main(void *arg) {
+    size_t tail = 0, partial = 0, n;
+    int waited = 0;
+    int done;
+
+    (void)arg;
+    for (;;) {
+        size_t const used = tail - __atomic_load_n(&reader.head, __ATOMIC_ACQUIRE);
+        size_t const i = tail % READER_RING_EVENTS;
+        size_t room = READER_RING_EVENTS - used;
+        ssize_t len;
+
+        /* Output has been stuck for long. Let the kernel hold events until
+         * the engine takes some. */
+        if (!room) {
+            uint64_t nwakes;
+
+            if (!waited)
+                __atomic_store_n(&reader.full, reader.full + 1, __ATOMIC_RELAXED);
+            waited = 1;
+            __atomic_store_n(&reader.waiting, 1, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&reader.head, __ATOMIC_SEQ_CST) + READER_RING_EVENTS == tail
+                && read(reader.room_fd, &nwakes, sizeof nwakes) < 0 && errno != EINTR)
+                exit(EXIT_FAILURE);
+            __atomic_store_n(&reader.waiting, 0, __ATOMIC_RELAXED);
+            continue;
+        }
+        waited = 0;
+
+        /* Events do not wrap around. */
+        if (room > READER_RING_EVENTS - i)
+            room = READER_RING_EVENTS - i;
+        if ((len = input_read((char *)&reader.ring[i] + partial, room * sizeof *reader.ring - partial)) <= 0) {
+            if (len < 0 && errno == EINTR)
+                continue;
+            done = len < 0 ? errno : 0;
+            break;
+        }
+
+        partial += len;
+        if (!(n = partial / sizeof *reader.ring))
+            continue;
+        tail += n;
+        partial %= sizeof *reader.ring;
+        __atomic_store_n(&reader.tail, tail, __ATOMIC_SEQ_CST);
+        if (used + n > reader.high)
+            __atomic_store_n(&reader.high, used + n, __ATOMIC_RELAXED);
+        reader_wake();
+    }
+
+    __atomic_store_n(&reader.done, done, __ATOMIC_SEQ_CST);
+    reader_wake();
+    return NULL;
+}
+
+/** Start reading input in a thread. Keep reading it in the engine if that is
+ * not possible. */
+static void
+reader_start(void) {
+    pthread_t thread;
+    sigset_t all, old;
+
+    /* Rather than while input waits. */
+    prefault(reader.ring, sizeof reader.ring);
+    if ((reader.room_fd = eventfd(0, EFD_CLOEXEC)) < 0)
+        return;
+    if ((reader.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        close(reader.room_fd);
+        return;
+    }
+
+    /* Signals are for the engine. */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    if (pthread_create(&thread, NULL, reader_main, NULL)) {
+        close(reader.wake_fd);
+        close(reader.room_fd);
+        reader.wake_fd = -1;
+    } else {
+        pthread_detach(thread);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/** Take events from the ring into `revbuf`, waiting for them while firing
+ * timers. Return what read(2) would, as if interrupted by a signal if there
+ * is no input yet. */
+static ssize_t
+reader_fill_events(void) {
+    size_t const head = reader.head;
+    size_t n, nfirst;
+    uint64_t nwakes;
+    int done;
+
+    while (!(n = __atomic_load_n(&reader.tail, __ATOMIC_SEQ_CST) - head)) {
+        if ((done = __atomic_load_n(&reader.done, __ATOMIC_SEQ_CST)) >= 0) {
+            /* Events read last are published before. */
+            if (__atomic_load_n(&reader.tail, __ATOMIC_ACQUIRE) != head)
+                continue;
+            if (done) {
+                errno = done;
+                return -1;
+            }
+            return 0;
+        }
+
+        __atomic_store_n(&reader.sleeping, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&reader.tail, __ATOMIC_SEQ_CST) == head
+            && __atomic_load_n(&reader.done, __ATOMIC_SEQ_CST) < 0
+            && !wait_input(reader.wake_fd)) {
+            __atomic_store_n(&reader.sleeping, 0, __ATOMIC_RELAXED);
+            errno = EINTR;
+            return -1;
+        }
+        __atomic_store_n(&reader.sleeping, 0, __ATOMIC_RELAXED);
+        if (read(reader.wake_fd, &nwakes, sizeof nwakes) < 0 && errno != EAGAIN)
+            exit(EXIT_FAILURE);
+    }
+
+    if (n > MAX_EVENTS)
+        n = MAX_EVENTS;
+    nfirst = READER_RING_EVENTS - head % READER_RING_EVENTS;
+    if (nfirst > n)
+        nfirst = n;
+    revbuf_rewind();
+    memcpy(revbuf, &reader.ring[head % READER_RING_EVENTS], nfirst * sizeof *revbuf);
+    memcpy(&revbuf[nfirst], reader.ring, (n - nfirst) * sizeof *revbuf);
+    __atomic_store_n(&reader.head, head + n, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&reader.waiting, __ATOMIC_SEQ_CST)) {
+        uint64_t const one = 1;
+        if (write(reader.room_fd, &one, sizeof one) < 0)
+            exit(EXIT_FAILURE);
+    }
+    revbuf_read(n * sizeof *revbuf);
+
+    if (stats_file) {
+        struct stats_header *const h = stats_file;
+
+        h->ring_size = READER_RING_EVENTS;
+        h->ring_high = __atomic_load_n(&reader.high, __ATOMIC_RELAXED);
+        h->ring_full = __atomic_load_n(&reader.full, __ATOMIC_RELAXED);
+    }
+    return n * sizeof *revbuf;
+}
+#endif
+
+/** Return whether there are more events to process. */
+static int
+read_events(void) {
+    for (;;) {
+        ssize_t len;
+
+#if !defined BENCH && !defined CHAIN_LEN
+        if (reload_pending) {
+            reload_rules();
+            continue;
+        }
+#endif
+#ifndef BENCH
+        if (replay.map)
+            len = replay_fill_events();
+        else
+#endif
+#ifdef URING
+        if (uring.fd >= 0)
+            len = uring_fill_events();
+        else
+#endif
+#ifdef READER
+        if (reader.wake_fd >= 0)
+            len = reader_fill_events();
+        else
+#endif
+        {
+#ifndef BENCH
+            /* Do not block in read(2) while timers are pending. */
+            if (timer_deadline && !wait_input(input_fd))
+                continue;
+#endif
+            len = fill_events();
+        }
+        switch (len) {
+        case -1:
+            if (errno == EINTR) {
+                handle_signals();
+                continue;
+            }
+            /* Fall through. */
+        case 0:
+#ifdef URING
+            uring_wait_write();
+#endif
+            return 0;
+        }
+
+        if (revlen > 0) {
+#ifndef BENCH
+            if (record.fd >= 0)
+                record.read_nsec = monotonic_nsec();
+#endif
+            return 1;
+        }
+    }
+}
+#endif /* CHAIN_STAGE */
+
+#ifndef CHAIN_DRIVER
+#ifdef LATENCY_STATS
+/** Stamp and path given to events written now, and of the current input. */
+static long long ev_stamp, ev_in_stamp;
+static unsigned char ev_path, ev_in_path;
+#endif
+static int is_typing = 0;
+static long long last_typing; /** Input time of last typing, usec. */
+/** Timestamp of the last input event. Written events take it. */
+static long curr_sec, curr_usec;
+/** The same in nsec, for timers. */
+#define CURR_NSEC() (curr_sec * 1000000000LL + curr_usec * 1000LL)
+/** Keys down on the output, one bit per code. Modifiers (and their
+ * aliases) share the first cache line. */
+static unsigned long matrix[BITSET_LEN(KEY_CNT)] __attribute__((aligned(64)));
+
+/** Rule tables with their dispatch index. They are compiled in, or mapped
+ * from a rule file (see `-r`). */
+static struct rules {
+    struct map_rule const *map;
+    struct tap_conf const *tap;
+    struct multi_conf const *multi;
+    struct layer_conf const *layer;
+    int nmap, ntap, nmulti, nlayer;
+    int check_typing; /** Whether any tap rule has `tap_typing`. */
+    int layer_max; /** Number of layers above the base layer 0. */
+    /** `map` index of the first rule mapping a key, or `-1`. */
+    short const *map_index;
+    /** `layer` index of the rule for a key on a layer, or `-1`, at
+     * `layer_index[layer * KEY_CNT + code]`. */
+    short const *layer_index;
+    /** Rules watching a key are listed at [`*_index_start[code]`,
+     * `*_index_start[code + 1]`) of `*_index` in ascending order. */
+    unsigned short const *tap_index_start;
+    unsigned short const *tap_index;
+    unsigned short const *multi_index_start;
+    unsigned short const *multi_index;
+    /** Keys of multi rules, as many as `multi_index` has. */
+    unsigned short const *multi_keys;
+    /** Tap rules with `hold_timeout_ms`. */
+    unsigned short const *tap_timed;
+    int ntap_timed;
+    /** Multi rules with `combo_ms`. */
+    unsigned short const *multi_timed;
+    int nmulti_timed;
+} rules;
+
+/* A specialized build (see `make SPECIALIZE=1`) only runs the compiled-in
+ * rules, and learns what they use from `SPEC_*` constants that `-S` printed,
+ * so that the compiler can drop everything else. */
+#ifdef SPECIALIZED
+# define RULES_NTAP ARRAY_LEN(TAP_RULES)
+# define HAS_MAP_RULES (ARRAY_LEN(MAP_RULES) > 0)
+# define HAS_TAP_RULES (ARRAY_LEN(TAP_RULES) > 0)
+# define HAS_MULTI_RULES (ARRAY_LEN(MULTI_RULES) > 0)
+# define HAS_LAYER_RULES (ARRAY_LEN(LAYER_RULES) > 0)
+# define HAS_TAP_TYPING SPEC_TAP_TYPING
+# define HAS_HOLD_IMMEDIATELY SPEC_HOLD_IMMEDIATELY
+# define HAS_ACTION_KEY SPEC_ACTION_KEY
+# define HAS_HOLD_TIMEOUT SPEC_HOLD_TIMEOUT
+# define HAS_COMBO SPEC_COMBO
+#else
+# define RULES_NTAP rules.ntap
+# define HAS_MAP_RULES 1
+# define HAS_TAP_RULES 1
+# define HAS_MULTI_RULES 1
+# define HAS_LAYER_RULES (rules.nlayer > 0)
+# define HAS_TAP_TYPING 1
+# define HAS_HOLD_IMMEDIATELY 1
+# define HAS_ACTION_KEY 1
+# define HAS_HOLD_TIMEOUT 1
+# define HAS_COMBO 1
+#endif
+#define CHECK_TYPING (HAS_TAP_TYPING && rules.check_typing)
+#define NTAP_TIMED (HAS_HOLD_TIMEOUT ? rules.ntap_timed : 0)
+#define NMULTI_TIMED (HAS_COMBO ? rules.nmulti_timed : 0)
+/* Fields of tap rule `v`, constant when no rule uses them. */
+#define TAP_TYPING(v) (HAS_TAP_TYPING && (v)->tap_typing)
+#define TAP_HOLD_IMMEDIATELY(v) (HAS_HOLD_IMMEDIATELY && (v)->hold_immediately)
+#define TAP_ACTION_KEY(v) (HAS_ACTION_KEY ? (v)->action_key : KEY_RESERVED)
+#define TAP_HOLD_TIMEOUT(v) (HAS_HOLD_TIMEOUT && (v)->hold_timeout_ms > 0)
+/* Of multi rule `v`. */
+#define MULTI_COMBO(v) (HAS_COMBO && (v)->combo_ms > 0)
+
+/* Dispatch index of the compiled-in rules, built by `build_index()`. */
+static short map_index[KEY_CNT];
+static unsigned short tap_index_start[KEY_CNT + 1];
+static unsigned short tap_index[2 * ARRAY_LEN(TAP_RULES) + 1];
+static unsigned short multi_index_start[KEY_CNT + 1];
+static unsigned short multi_index[MULTI_MAX_KEYS * ARRAY_LEN(MULTI_RULES) + 1];
+static unsigned short multi_keys[MULTI_MAX_KEYS * ARRAY_LEN(MULTI_RULES) + 1];
+static struct multi_conf multi_conf[ARRAY_LEN(MULTI_RULES) + 1];
+static unsigned short tap_timed[ARRAY_LEN(TAP_RULES) + 1];
+static unsigned short multi_timed[ARRAY_LEN(MULTI_RULES) + 1];
+static struct tap_conf tap_conf[ARRAY_LEN(TAP_RULES) + 1];
+static short layer_index[(ARRAY_LEN(LAYER_RULES) + 1) * KEY_CNT];
+static struct layer_conf layer_conf[ARRAY_LEN(LAYER_RULES) + 1];
+
+/* State of `rules`, see `state_alloc()`. */
+static struct tap_state *tap_state;
+static struct tap_cold *tap_cold;
+static struct multi_state *multi_state;
+/** Keys down as multi rules have seen them. */
+static unsigned long *multi_keys_down;
+/** Presses held back while `combo_ms` of multi rules elapses, in the order
+ * they were read. */
+static unsigned short *combo_held;
+static int combo_nheld;
+static long long combo_deadline; /** When the first open window closes. */
+/** Tap rules that react to any key in their current state. */
+static unsigned long *tap_active;
+static unsigned long *tap_visit;
+/** Layers switched on, the last one on top. */
+static unsigned char *layer_stack;
+static int layer_depth;
+static int layer_top; /** Layer on top, or 0. */
+/** Layer rule that a key has been pressed through plus one, or 0, so that it
+ * is released on the same layer. */
+static unsigned short *layer_pressed;
+/** Hold rule plus one that may still act as its `tap_key`, or 0. */
+static int layer_tap;
+
+/* Counters of `rules`, in memory from `stats_alloc()` or in the file of `-m`
+ * after `stats_place()`. */
+static struct stats_stage *stats;
+static uint64_t *stats_map;
+static struct stats_tap *stats_tap;
+static struct stats_multi *stats_multi;
+static uint64_t *stats_layer;
+static void *stats_heap;
+
+__attribute__((const))
+static int
+key_ismod(int code) {
+    switch (code) {
+    default:
+        return 0;
+    case KEY_LEFTSHIFT: case KEY_RIGHTSHIFT:
+    case KEY_LEFTCTRL:  case KEY_RIGHTCTRL:
+    case KEY_LEFTALT:   case KEY_RIGHTALT:
+    case KEY_LEFTMETA:  case KEY_RIGHTMETA:
+        return 1;
+    }
+}
+
+/** The key on the other side of a left and right modifier pair, or `code`
+ * itself. */
+__attribute__((const))
+static int
+key_alias(int code) {
+    switch (code) {
+    default:
+        return code;
+    case KEY_LEFTSHIFT:  return KEY_RIGHTSHIFT;
+    case KEY_RIGHTSHIFT: return KEY_LEFTSHIFT;
+    case KEY_LEFTCTRL:   return KEY_RIGHTCTRL;
+    case KEY_RIGHTCTRL:  return KEY_LEFTCTRL;
+    case KEY_LEFTALT:    return KEY_RIGHTALT;
+    case KEY_RIGHTALT:   return KEY_LEFTALT;
+    case KEY_LEFTMETA:   return KEY_RIGHTMETA;
+    case KEY_RIGHTMETA:  return KEY_LEFTMETA;
+    }
+}
+
+static void combo_flush(void);
+
+static void
+write_event(struct input_event const *e) {
+    /* Keys held back for a chord were pressed before anything written now.
+     * Repeats do not tell apart chords from keys typed. */
+    if (NMULTI_TIMED && combo_nheld && e->type == EV_KEY && e->value != EVENT_VALUE_KEYREPEAT)
+        combo_flush();
+
+    /* Codes beyond `KEY_MAX` are passed on as they are. */
+    if (e->type == EV_KEY && e->code < KEY_CNT) {
+        int const is_down = BITSET_GET(matrix, e->code);
+
+        /* Drop presses of keys that are down and releases and repeats of
+         * keys that are up, as the kernel would drop them anyway. */
+        if (e->value == EVENT_VALUE_KEYDOWN ? is_down : !is_down) {
+            TRACE(OUTPUT_DROPPED, 0, e->code, e->value);
+            return;
+        }
+        TRACE(OUTPUT, 0, e->code, e->value);
+        if (e->value == EVENT_VALUE_KEYDOWN)
+            BITSET_SET(matrix, e->code);
+        else if (e->value == EVENT_VALUE_KEYUP)
+            BITSET_CLEAR(matrix, e->code);
+        if (CHECK_TYPING) {
+            if (!is_typing && e->value == EVENT_VALUE_KEYUP && !key_ismod(e->code)) {
+                is_typing = 1;
+                last_typing = curr_sec * 1000000LL + curr_usec;
+                TRACE(TYPING, 0, e->code, 1);
+            }
+        }
+    }
+
+    ++stats->events_out;
+    LATENCY_OUTPUT();
+    output_event(e);
+}
+
+static void
+write_key_event(int code, int value) {
+    struct input_event e = {
+        .type = EV_KEY,
+        .code = code,
+        .value = value
+    };
+    e.input_event_sec = curr_sec;
+    e.input_event_usec = curr_usec;
+    write_event(&e);
+}
+
+static void
+write_syn_report(void) {
+    struct input_event e = {
+        .type = EV_SYN,
+        .code = SYN_REPORT,
+    };
+    e.input_event_sec = curr_sec;
+    e.input_event_usec = curr_usec;
+    write_event(&e);
+}
+
+static int
+matrix_iskeydown(int code) {
+    return BITSET_GET(matrix, code) || BITSET_GET(matrix, key_alias(code));
+}
+
+/** Write the presses held back for chords, and close the windows of multi
+ * rules, as no chord has completed within them. */
+static void
+combo_flush(void) {
+    int const n = combo_nheld;
+    int j;
+
+    combo_nheld = 0;
+    combo_deadline = 0;
+    for (j = 0; j < NMULTI_TIMED; ++j) {
+        int const i = rules.multi_timed[j];
+        if (multi_state[i].combo_open) {
+            multi_state[i].combo_open = 0;
+            TRACE(MULTI_COMBO_MISSED, i, n ? combo_held[0] : KEY_RESERVED, 0);
+            ++stats_multi[i].missed;
+        }
+    }
+    for (j = 0; j < n; ++j)
+        write_key_event(combo_held[j], EVENT_VALUE_KEYDOWN);
+}
+
+/** Set bits of keys that rules may write. */
+static void
+rule_output_keys(unsigned long *keys) {
+    int i, j;
+
+#define OUTPUT_KEY(code) ((code) > KEY_RESERVED ? BITSET_SET(keys, code) : 0)
+    for (i = 0; i < rules.nmap; ++i)
+        OUTPUT_KEY(rules.map[i].to_key);
+    for (i = 0; i < rules.ntap; ++i) {
+        OUTPUT_KEY(rules.tap[i].tap_key);
+        OUTPUT_KEY(rules.tap[i].hold_key);
+        OUTPUT_KEY(rules.tap[i].repeat_key);
+    }
+    for (i = 0; i < rules.nmulti; ++i)
+        for (j = 0; j < 2; ++j) {
+            OUTPUT_KEY(rules.multi[i].down_press[j]);
+            OUTPUT_KEY(rules.multi[i].up_press[j]);
+        }
+    for (i = 0; i < rules.nlayer; ++i) {
+        OUTPUT_KEY(rules.layer[i].to_key);
+        OUTPUT_KEY(rules.layer[i].tap_key);
+    }
+#undef OUTPUT_KEY
+
+#ifdef CHAIN_STAGE
+    CHAIN_CAT(chain_stage_keys, CHAIN_NEXT)(keys);
+#endif
+}
+
+/* Arrays of engine state with their lengths for `rules`. Tables have one
+ * more entry, so that empty ones are not special. A key is held back for
+ * chords once until the windows close. */
+#define STATE_ARRAYS(ARRAY) \
+    ARRAY(tap_state, rules.ntap + 1) \
+    ARRAY(tap_cold, rules.ntap + 1) \
+    ARRAY(multi_state, rules.nmulti + 1) \
+    ARRAY(multi_keys_down, BITSET_LEN(KEY_CNT)) \
+    ARRAY(combo_held, rules.multi_index_start[KEY_CNT] + 1) \
+    ARRAY(tap_active, BITSET_LEN(rules.ntap)) \
+    ARRAY(tap_visit, BITSET_LEN(rules.ntap)) \
+    ARRAY(layer_stack, rules.layer_max + 1) \
+    ARRAY(layer_pressed, HAS_LAYER_RULES ? KEY_CNT : 1)
+
+/** Replace the state of the engine with a clear one for `rules`. */
+static void
+state_reset(void) {
+#define STATE_FREE(array, len) free(array);
+#define STATE_ALLOC(array, len) if (!(array = calloc(len, sizeof *array))) exit(EXIT_FAILURE);
+    STATE_ARRAYS(STATE_FREE)
+    STATE_ARRAYS(STATE_ALLOC)
+#undef STATE_FREE
+#undef STATE_ALLOC
+    layer_depth = 0, layer_top = 0, layer_tap = 0;
+    is_typing = 0;
+    combo_nheld = 0, combo_deadline = 0;
+    timer_deadline = 0, timer_stale = 0;
+}
+
+#ifndef BENCH
+/** Fault in the state and counters of the engine (see `realtime_lock()`). */
+static void
+state_prefault(void) {
+#define STATE_PREFAULT(array, len) prefault(array, (len) * sizeof *array);
+    STATE_ARRAYS(STATE_PREFAULT)
+#undef STATE_PREFAULT
+    prefault(matrix, sizeof matrix);
+    prefault(stats, STATS_STAGE_SIZE(rules.nmap, rules.ntap, rules.nmulti, rules.nlayer));
+
+#ifdef CHAIN_STAGE
+    CHAIN_CAT(chain_stage_prefault, CHAIN_NEXT)();
+#endif
+}
+#endif
+
+static void
+stats_point(struct stats_stage *s) {
+    stats = s;
+    stats_map = (uint64_t *)(s + 1);
+    stats_tap = (struct stats_tap *)(stats_map + rules.nmap);
+    stats_multi = (struct stats_multi *)(stats_tap + rules.ntap);
+    stats_layer = (uint64_t *)(stats_multi + rules.nmulti);
+}
+
+/** Replace counters with zeroed ones for `rules`. */
+static void
+stats_alloc(void) {
+    size_t const size = STATS_STAGE_SIZE(rules.nmap, rules.ntap, rules.nmulti, rules.nlayer);
+
+    free(stats_heap);
+    if (!(stats_heap = calloc(1, size)))
+        exit(EXIT_FAILURE);
+    stats_point(stats_heap);
+    strncpy(stats->name, CONFIG_NAME, sizeof stats->name - 1);
+    stats->nmap = rules.nmap;
+    stats->ntap = rules.ntap;
+    stats->nmulti = rules.nmulti;
+    stats->nlayer = rules.nlayer;
+}
+
+/** Move counters to `*off` of `base`, then the ones of the next stages after
+ * them. Only add up their size to `*off` if `base` is `NULL`. */
+static void
+stats_place(char *base, size_t *off) {
+    size_t const size = STATS_STAGE_SIZE(rules.nmap, rules.ntap, rules.nmulti, rules.nlayer);
+
+    if (base) {
+        memcpy(base + *off, stats, size);
+        stats_point((struct stats_stage *)(base + *off));
+        free(stats_heap);
+        stats_heap = NULL;
+    }
+    *off += size;
+#ifdef CHAIN_STAGE
+    CHAIN_CAT(chain_stage_stats, CHAIN_NEXT)(base, off);
+#endif
+}
+
+#if defined SPECIALIZED || (!defined BENCH && !defined CHAIN_LEN)
+/** Features of `rules` that are `SPEC_<NAME>` constants when specialized. */
+struct rule_spec {
+    int tap_typing, hold_immediately, action_key, hold_timeout, combo;
+};
+
+#define RULE_SPEC_FIELDS(FIELD) \
+    FIELD(TAP_TYPING, tap_typing) \
+    FIELD(HOLD_IMMEDIATELY, hold_immediately) \
+    FIELD(ACTION_KEY, action_key) \
+    FIELD(HOLD_TIMEOUT, hold_timeout) \
+    FIELD(COMBO, combo)
+
+static void
+rules_spec(struct rule_spec *f) {
+    int i;
+
+    memset(f, 0, sizeof *f);
+    f->tap_typing = rules.check_typing;
+    for (i = 0; i < rules.ntap; ++i) {
+        f->hold_immediately |= rules.tap[i].hold_immediately;
+        f->action_key |= rules.tap[i].action_key != KEY_RESERVED;
+    }
+    f->hold_timeout = rules.ntap_timed > 0;
+    f->combo = rules.nmulti_timed > 0;
+}
+#endif
+
+__attribute__((constructor))
+static void
+build_index(void) {
+    int i, j, n, code;
+
+    /* A longer `.keys` list does not compile: its excess elements are
+     * diagnosed, which the flags of the Makefile make an error. Whatever
+     * fits has to be counted in `multi_index` and `keys_start`. */
+    _Static_assert(MULTI_MAX_KEYS * ARRAY_LEN(MULTI_RULES) < UINT16_MAX,
+                   "Keys of multi rules do not fit their index; lower MULTI_MAX_KEYS");
+
+    rules.map = MAP_RULES, rules.nmap = ARRAY_LEN(MAP_RULES);
+    rules.tap = tap_conf, rules.ntap = ARRAY_LEN(TAP_RULES);
+    rules.multi = multi_conf, rules.nmulti = ARRAY_LEN(MULTI_RULES);
+    rules.layer = layer_conf, rules.nlayer = ARRAY_LEN(LAYER_RULES);
+    rules.map_index = map_index;
+    rules.layer_index = layer_index;
+    rules.tap_index_start = tap_index_start;
+    rules.tap_index = tap_index;
+    rules.multi_index_start = multi_index_start;
+    rules.multi_index = multi_index;
+    rules.multi_keys = multi_keys;
+    rules.tap_timed = tap_timed;
+    rules.multi_timed = multi_timed;
+
+    for (code = 0; code < KEY_CNT; ++code)
+        map_index[code] = -1;
+    for (i = 0; i < ARRAY_LEN(MAP_RULES); ++i) {
+        struct map_rule const *const v = &MAP_RULES[i];
+        if (map_index[v->from_key] < 0)
+            map_index[v->from_key] = i;
+    }
+
+    for (i = 0; i < ARRAY_LEN(TAP_RULES); ++i) {
+        struct tap_rule const *const v = &TAP_RULES[i];
+        struct tap_conf *const c = &tap_conf[i];
+
+        c->base_key = v->base_key;
+        c->tap_key = v->tap_key;
+        c->hold_key = v->hold_key;
+        c->repeat_key = v->repeat_key;
+        c->action_key = v->action_key;
+        c->tap_mods = !!v->tap_mods;
+        c->hold_immediately = !!v->hold_immediately;
+        c->tap_typing = !!v->tap_typing;
+        c->repeat_delay = v->repeat_delay;
+        c->hold_timeout_ms = v->hold_timeout_ms;
+
+        c->first_sibling = i;
+        c->next_sibling = TAP_NO_SIBLING;
+        for (j = i; j-- > 0;) {
+            if (tap_conf[j].base_key == c->base_key
+                && tap_conf[j].tap_key == c->tap_key) {
+                c->first_sibling = tap_conf[j].first_sibling;
+                tap_conf[j].next_sibling = i;
+                break;
+            }
+        }
+
+        if (v->hold_timeout_ms > 0)
+            tap_timed[rules.ntap_timed++] = i;
+        if (v->tap_typing)
+            rules.check_typing = 1;
+    }
+
+    /* Count rules per key first, then fill the lists backwards. */
+    for (i = 0; i < ARRAY_LEN(TAP_RULES); ++i) {
+        struct tap_rule const *const v = &TAP_RULES[i];
+        ++tap_index_start[v->base_key];
+        if (v->action_key != KEY_RESERVED && v->action_key != v->base_key)
+            ++tap_index_start[v->action_key];
+    }
+    for (i = 0, n = 0; i < ARRAY_LEN(MULTI_RULES); ++i) {
+        struct multi_rule const *const v = &MULTI_RULES[i];
+        struct multi_conf *const c = &multi_conf[i];
+
+        c->keys_start = n;
+        for (j = 0; j < ARRAY_LEN(v->keys) && v->keys[j] != KEY_RESERVED; ++j) {
+            int k;
+
+            /* Watch keys listed more than once only once. */
+            for (k = c->keys_start; k < n && multi_keys[k] != v->keys[j]; ++k)
+                ;
+            if (k == n)
+                multi_keys[n++] = v->keys[j], ++multi_index_start[v->keys[j]];
+        }
+        c->nkeys = n - c->keys_start;
+        c->down_press[0] = v->down_press[0], c->down_press[1] = v->down_press[1];
+        c->up_press[0] = v->up_press[0], c->up_press[1] = v->up_press[1];
+        c->nbeforedown = v->nbeforedown;
+        c->nbeforeup = v->nbeforeup;
+        c->nup = v->nup;
+        c->combo_ms = v->combo_ms;
+
+        if (v->combo_ms > 0)
+            multi_timed[rules.nmulti_timed++] = i;
+    }
+    for (code = 1; code <= KEY_CNT; ++code) {
+        tap_index_start[code] += tap_index_start[code - 1];
+        multi_index_start[code] += multi_index_start[code - 1];
+    }
+    for (i = ARRAY_LEN(TAP_RULES); i-- > 0;) {
+        struct tap_rule const *const v = &TAP_RULES[i];
+        tap_index[--tap_index_start[v->base_key]] = i;
+        if (v->action_key != KEY_RESERVED && v->action_key != v->base_key)
+            tap_index[--tap_index_start[v->action_key]] = i;
+    }
+    for (i = ARRAY_LEN(MULTI_RULES); i-- > 0;) {
+        struct multi_conf const *const c = &multi_conf[i];
+        for (j = c->keys_start; j < c->keys_start + c->nkeys; ++j)
+            multi_index[--multi_index_start[multi_keys[j]]] = i;
+    }
+
+    for (i = 0; i < ARRAY_LEN(LAYER_RULES); ++i) {
+        struct layer_rule const *const v = &LAYER_RULES[i];
+        struct layer_conf *const c = &layer_conf[i];
+
+        c->key = v->key;
+        c->to_key = v->to_key;
+        c->tap_key = v->tap_key;
+        c->hold = !!v->hold;
+        c->toggle = !!v->toggle;
+        if (v->layer <= 0) {
+            fprintf(stderr, "k2k: Layer rule #%d has no layer\n", i);
+            exit(EXIT_FAILURE);
+        }
+        for (j = 0; j < i; ++j)
+            if (LAYER_RULES[j].layer == v->layer)
+                break;
+        if (j < i) {
+            c->layer = layer_conf[j].layer;
+        } else if (rules.layer_max < UINT8_MAX) {
+            c->layer = ++rules.layer_max;
+        } else {
+            fputs("k2k: Too many layers\n", stderr);
+            exit(EXIT_FAILURE);
+        }
+    }
+    /* The first rule for a key wins, and switching beats mapping. */
+    for (i = 0; i < (rules.layer_max + 1) * KEY_CNT; ++i)
+        layer_index[i] = -1;
+    for (i = ARRAY_LEN(LAYER_RULES); i-- > 0;) {
+        struct layer_conf const *const c = &layer_conf[i];
+        if (!c->hold && !c->toggle)
+            layer_index[c->layer * KEY_CNT + c->key] = i;
+    }
+    for (i = ARRAY_LEN(LAYER_RULES); i-- > 0;) {
+        struct layer_conf const *const c = &layer_conf[i];
+        if (c->hold || c->toggle)
+            for (j = 0; j <= rules.layer_max; ++j)
+                layer_index[j * KEY_CNT + c->key] = i;
+    }
+    stats_alloc();
+
+#ifdef SPECIALIZED
+    {
+        struct rule_spec f;
+        int ok = 1;
+
+        rules_spec(&f);
+# define FIELD(name, field) ok = ok && f.field == SPEC_##name;
+        RULE_SPEC_FIELDS(FIELD)
+# undef FIELD
+        if (!ok) {
+            fputs("k2k: Specialized for other rules\n", stderr);
+            exit(EXIT_FAILURE);
+        }
+    }
+#endif
+
+    state_reset();
+}
+
+/** Update whether tap rule `i` has to see every key. */
+static void
+tap_update_active(int i) {
+    struct tap_conf const *const v = &rules.tap[i];
+    int const act_key = tap_state[i].act_key;
+    if (TAP_ACTION_KEY(v) == KEY_RESERVED ? act_key == -1 : act_key > 0)
+        BITSET_SET(tap_active, i);
+    else
+        BITSET_CLEAR(tap_active, i);
+}
+
+/** Forget the hold timeout of tap rule `i`, which is no longer armed. */
+static void
+tap_disarm(int i) {
+    struct tap_cold *const c = &tap_cold[i];
+
+    if (TAP_HOLD_TIMEOUT(&rules.tap[i]) && c->hold_deadline) {
+        if (c->hold_deadline == timer_deadline)
+            timer_stale = 1;
+        c->hold_deadline = 0;
+    }
+}
+
+static void
+tap_rule_repeat(int i) {
+    struct tap_conf const *const v = &rules.tap[i];
+    struct tap_state *const s = &tap_state[i];
+
+    TRACE(TAP_REPEATED, i, v->repeat_key, 1);
+    ++stats_tap[i].repeated;
+    LATENCY_RESOLVE(i);
+    tap_disarm(i);
+    if (TAP_HOLD_IMMEDIATELY(v))
+        write_key_event(v->hold_key, EVENT_VALUE_KEYUP);
+    s->act_key = v->repeat_key;
+    write_key_event(s->act_key, EVENT_VALUE_KEYDOWN);
+}
+
+static void
+tap_rule_hold(int i) {
+    struct tap_conf const *const v = &rules.tap[i];
+    struct tap_state *const s = &tap_state[i];
+    int j;
+
+    TRACE(TAP_HELD, i, v->hold_key, 1);
+    ++stats_tap[i].held;
+    LATENCY_RESOLVE(i);
+    tap_disarm(i);
+    s->act_key = v->hold_key;
+    /* s->was_held = 1; */
+    for (j = v->first_sibling; j != TAP_NO_SIBLING; j = rules.tap[j].next_sibling)
+        tap_state[j].was_held = 1;
+    /* If `hold_key` was pressed in advance, we don't have to
+     * press it again. */
+    if (!TAP_HOLD_IMMEDIATELY(v))
+        write_key_event(s->act_key, EVENT_VALUE_KEYDOWN);
+}
+
+/** Feed `e` to tap rule `i`. Return whether `e` has been consumed. */
+static int
+tap_rule_event(int i, struct input_event const *e) {
+    struct tap_conf const *const v = &rules.tap[i];
+    struct tap_state *const s = &tap_state[i];
+    int ignore = 0;
+
+    if (e->code == v->base_key) {
+        switch (e->value) {
+        case EVENT_VALUE_KEYDOWN:
+            if (s->act_key == KEY_RESERVED) {
+                s->was_held = 0;
+                if ((is_typing && TAP_TYPING(v)) || matrix_iskeydown(v->hold_key)) {
+                    TRACE(TAP_IMMEDIATELY, i, v->tap_key, 1);
+                    ++stats_tap[i].tapped;
+                    LATENCY_PATH(LATENCY_TAP);
+                    s->act_key = v->tap_key;
+                    write_key_event(v->tap_key, EVENT_VALUE_KEYDOWN);
+                } else {
+                tap_rearm:
+                    TRACE(TAP_ARMED, i, v->base_key, 1);
+                    LATENCY_ARM(i);
+                    s->act_key = -1;
+                    /* A hold modifier keys can be pressed now and released
+                     * if need to act as tap key in the future. */
+                    if (TAP_HOLD_IMMEDIATELY(v))
+                        write_key_event(v->hold_key, EVENT_VALUE_KEYDOWN);
+                    tap_cold[i].curr_delay = v->repeat_delay;
+                    if (TAP_HOLD_TIMEOUT(v)) {
+                        long long const deadline = CURR_NSEC() + v->hold_timeout_ms * 1000000LL;
+                        tap_cold[i].hold_deadline = deadline;
+                        if (!timer_deadline || deadline < timer_deadline)
+                            timer_deadline = deadline;
+                    }
+                }
+            }
+            return 1;
+        case EVENT_VALUE_KEYREPEAT:
+            switch (s->act_key) {
+            case KEY_RESERVED:
+                /* Do nothing. */
+                break;
+            case -1:
+                /* Always ignore if we haven't decided what key it
+                 * should be. */
+                ignore = 1;
+
+                /* Do not repeat this key. */
+                if (v->repeat_key == KEY_RESERVED)
+                    return ignore;
+
+                /* Wait for more key repeats. */
+                if (tap_cold[i].curr_delay-- > 0)
+                    return ignore;
+
+                /* Timeout reached, act as repeat key. */
+                tap_rule_repeat(i);
+                break;
+            default:
+                ignore = 1;
+                write_key_event(s->act_key, EVENT_VALUE_KEYREPEAT);
+                break;
+            }
+            break;
+        case EVENT_VALUE_KEYUP:
+            switch (s->act_key) {
+            case KEY_RESERVED:
+                /* Do nothing. */
+                break;
+            case -1:
+                tap_disarm(i);
+                /* We've been already hold down with other keys, so we
+                 * mustn't tap now. */
+                if (!s->was_held) {
+                    int j;
+                    for (j = i; j != TAP_NO_SIBLING; j = rules.tap[j].next_sibling)
+                        tap_state[j].was_held = 1;
+                    /* We aren't up until now how this key should act. */
+                    TRACE(TAP_TAPPED, i, v->tap_key, 1);
+                    ++stats_tap[i].tapped;
+                    LATENCY_RESOLVE(i);
+                    s->act_key = v->tap_key;
+                    if (TAP_HOLD_IMMEDIATELY(v))
+                        write_key_event(v->hold_key, EVENT_VALUE_KEYUP);
+                    write_key_event(s->act_key, EVENT_VALUE_KEYDOWN);
+                } else {
+                    TRACE(TAP_TAP_IGNORED, i, v->base_key, 1);
+                    ++stats_tap[i].ignored;
+                    /* Fall through. */
+            default:
+                    if (TAP_ACTION_KEY(v) != KEY_RESERVED && s->act_key == v->hold_key) {
+                        TRACE(TAP_ACTION_KEY_UP, i, v->action_key, 1);
+                        write_key_event(v->action_key, EVENT_VALUE_KEYDOWN);
+                    }
+                }
+
+                TRACE(TAP_UP, i, s->act_key == -1 ? KEY_RESERVED : s->act_key, 0);
+                ignore = 1;
+                if (s->act_key != -1)
+                    write_key_event(s->act_key, EVENT_VALUE_KEYUP);
+                s->act_key = KEY_RESERVED;
+                break;
+            }
+            break;
+        }
+    } else if (s->act_key == -1
+            && e->value == EVENT_VALUE_KEYDOWN
+            && (TAP_ACTION_KEY(v) == KEY_RESERVED
+                || (e->code == v->action_key && (!key_ismod(e->code) || !v->tap_mods)))) {
+        if (TAP_ACTION_KEY(v) != KEY_RESERVED)
+            ignore = 1;
+        /* User started typing meanwhile. */
+        if ((is_typing && TAP_TYPING(v)) && !s->was_held) {
+            TRACE(TAP_LATE_TAP, i, v->tap_key, 1);
+            ++stats_tap[i].late_tap;
+            LATENCY_RESOLVE(i);
+            tap_disarm(i);
+            s->act_key = v->tap_key;
+            write_key_event(v->tap_key, EVENT_VALUE_KEYDOWN);
+        } else {
+            tap_rule_hold(i);
+        }
+    } else if (s->act_key > 0 && TAP_ACTION_KEY(v) != KEY_RESERVED) {
+        if (e->value == EVENT_VALUE_KEYUP) {
+            TRACE(TAP_DEARMED, i, e->code, e->value);
+            write_key_event(s->act_key, EVENT_VALUE_KEYUP);
+            goto tap_rearm;
+        } else {
+            TRACE(TAP_ACTION_KEY_IGNORED, i, e->code, e->value);
+            ignore = 1;
+        }
+    }
+    return ignore;
+}
+
+/** Whether layer `n` is switched on. */
+static int
+layer_is_on(int n) {
+    int k;
+
+    for (k = 0; k < layer_depth; ++k)
+        if (layer_stack[k] == n)
+            return 1;
+    return 0;
+}
+
+/** Switch the layer of rule `i` on, on top of the others. */
+static void
+layer_on(int i) {
+    int const n = rules.layer[i].layer;
+
+    TRACE(LAYER_ON, i, rules.layer[i].key, n);
+    if (!layer_is_on(n))
+        layer_stack[layer_depth++] = n;
+    layer_top = n;
+}
+
+/** Switch the layer of rule `i` off, wherever it is in the stack. */
+static void
+layer_off(int i) {
+    int const n = rules.layer[i].layer;
+    int k;
+
+    TRACE(LAYER_OFF, i, rules.layer[i].key, n);
+    for (k = 0; k < layer_depth; ++k)
+        if (layer_stack[k] == n) {
+            memmove(&layer_stack[k], &layer_stack[k + 1], layer_depth - k - 1);
+            --layer_depth;
+            break;
+        }
+    layer_top = layer_depth > 0 ? layer_stack[layer_depth - 1] : 0;
+}
+
+/** Map `e` on the layer on top, or switch layers by it. Keys are released
+ * through the rule they were pressed through. Return whether `e` has been
+ * consumed. */
+static int
+layer_event(struct input_event *e) {
+    struct layer_conf const *v;
+    int i;
+
+    if (e->value == EVENT_VALUE_KEYDOWN) {
+        i = rules.layer_index[layer_top * KEY_CNT + e->code];
+        layer_pressed[e->code] = i + 1;
+        /* Other keys pressed meanwhile make it a hold. */
+        if (layer_tap != i + 1)
+            layer_tap = 0;
+    } else {
+        i = layer_pressed[e->code] - 1;
+        if (e->value == EVENT_VALUE_KEYUP)
+            layer_pressed[e->code] = 0;
+    }
+    if (i < 0)
+        return 0;
+
+    v = &rules.layer[i];
+    ++stats_layer[i];
+    if (!v->hold && !v->toggle) {
+        TRACE(LAYER_MAP, i, v->to_key, e->value);
+        if (v->to_key == KEY_RESERVED) {
+            ++stats->map_dropped;
+            return 1;
+        }
+        LATENCY_PATH(LATENCY_MAP);
+        e->code = v->to_key;
+        return 0;
+    }
+
+    ++stats->consumed;
+    if (e->value == EVENT_VALUE_KEYDOWN) {
+        if (v->toggle && layer_is_on(v->layer))
+            layer_off(i);
+        else
+            layer_on(i);
+        if (v->hold)
+            layer_tap = i + 1;
+    } else if (e->value == EVENT_VALUE_KEYUP && v->hold) {
+        layer_off(i);
+        if (layer_tap == i + 1) {
+            layer_tap = 0;
+            if (v->tap_key != KEY_RESERVED) {
+                TRACE(LAYER_TAPPED, i, v->tap_key, 1);
+                write_key_event(v->tap_key, EVENT_VALUE_KEYDOWN);
+                write_key_event(v->tap_key, EVENT_VALUE_KEYUP);
+            }
+        }
+    }
+    return 1;
+}
+
+static void
+process_event(struct input_event e) {
+    int i, k;
+    int ignore = 0;
+    int held = 0;
+    int delta = 0;
+
+    LATENCY_ENTER();
+    curr_sec = e.input_event_sec;
+    curr_usec = e.input_event_usec;
+    ++stats->events_in;
+
+    if (e.type != EV_KEY) {
+        /* We don't care about scan codes. */
+        if (e.type == EV_MSC && e.code == MSC_SCAN) {
+            ++stats->scan_dropped;
+            return;
+        }
+        goto write;
+    }
+    /* Rules only know codes up to `KEY_MAX`. */
+    if (e.code >= KEY_CNT)
+        goto write;
+
+    TRACE(INPUT, 0, e.code, e.value);
+
+    if (HAS_MAP_RULES && (i = rules.map_index[e.code]) >= 0) {
+        struct map_rule const *const v = &rules.map[i];
+        ++stats_map[i];
+        if (v->to_key != KEY_RESERVED) {
+            TRACE(MAP, i, v->to_key, e.value);
+            LATENCY_PATH(LATENCY_MAP);
+            e.code = v->to_key;
+        } else {
+            TRACE(MAP, i, KEY_RESERVED, e.value);
+            ++stats->map_dropped;
+            return;
+        }
+    }
+
+    if (HAS_LAYER_RULES && layer_event(&e))
+        return;
+
+    /* Check if user is typing. */
+    if (CHECK_TYPING) {
+        if (is_typing && e.value != EVENT_VALUE_KEYUP) {
+            long long const now = EVENT_TIME_USEC(e);
+            long long const elapsed_usec = now - last_typing;
+            last_typing = now;
+            is_typing = (elapsed_usec <= TYPING_TIMEOUT_MSEC * 1000LL);
+            if (!is_typing)
+                TRACE(TYPING, 0, e.code, 0);
+        }
+    }
+
+    if (HAS_TAP_RULES) {
+        /* Visit rules watching `e.code` and rules reacting to any key in
+         * ascending order, as rules may affect each other. */
+        memcpy(tap_visit, tap_active, BITSET_LEN(RULES_NTAP) * sizeof *tap_visit);
+        for (k = rules.tap_index_start[e.code]; k < rules.tap_index_start[e.code + 1]; ++k)
+            BITSET_SET(tap_visit, rules.tap_index[k]);
+        for (k = 0; k < BITSET_LEN(RULES_NTAP); ++k) {
+            while (tap_visit[k]) {
+                i = k * LONG_BITS + __builtin_ctzl(tap_visit[k]);
+                tap_visit[k] &= tap_visit[k] - 1;
+                ignore |= tap_rule_event(i, &e);
+                tap_update_active(i);
+                LATENCY_RESTORE();
+            }
+        }
+        if (ignore) {
+            ++stats->consumed;
+            return;
+        }
+    }
+
+    if (!HAS_MULTI_RULES)
+        goto write;
+
+    /* Down keys are counted per rule as they change, so rules cost the same
+     * whatever many keys they have. */
+    k = rules.multi_index_start[e.code];
+    if (k < rules.multi_index_start[e.code + 1]) {
+        if (e.value == EVENT_VALUE_KEYDOWN && !BITSET_GET(multi_keys_down, e.code))
+            BITSET_SET(multi_keys_down, e.code), delta = 1;
+        else if (e.value == EVENT_VALUE_KEYUP && BITSET_GET(multi_keys_down, e.code))
+            BITSET_CLEAR(multi_keys_down, e.code), delta = -1;
+    }
+
+    /* A held back key that is released or repeats is typed, not part of a
+     * chord. */
+    if (NMULTI_TIMED && combo_nheld && e.value != EVENT_VALUE_KEYDOWN)
+        for (i = 0; i < combo_nheld; ++i)
+            if (combo_held[i] == e.code) {
+                combo_flush();
+                break;
+            }
+
+    for (; k < rules.multi_index_start[e.code + 1]; ++k) {
+        struct multi_conf const *const v = &rules.multi[i = rules.multi_index[k]];
+        struct multi_state *const s = &multi_state[i];
+        unsigned short const *const keys = &rules.multi_keys[v->keys_start];
+        int const ntotal = v->nkeys;
+        int j, ndown;
+        int nkeys;
+
+        ndown = s->ndown += delta;
+
+        if (s->repeated_key == e.code)
+            s->repeated_key = KEY_RESERVED;
+
+        if (e.value == EVENT_VALUE_KEYREPEAT) {
+            if (s->repeated_key == KEY_RESERVED || s->repeated_key == e.code) {
+                s->repeated_key_repeated = 1;
+                s->repeated_key = e.code;
+            } else if (!s->repeated_key_repeated && s->repeating_key == e.code) {
+                s->repeated_key_repeated = 1;
+                s->repeated_key = e.code;
+                TRACE(MULTI_REPEATING_KEY, i, e.code, e.value);
+            } else {
+                s->repeated_key_repeated = 0;
+                s->repeating_key = e.code;
+            }
+        }
+
+        /* Chords only toggle down within the window opened by their first
+         * key, and their keys are held back until then. */
+        if (MULTI_COMBO(v) && !s->is_down) {
+            if (delta > 0 && ndown == 1 && !ignore) {
+                long long const deadline = CURR_NSEC() + v->combo_ms * 1000000LL;
+                s->combo_open = 1;
+                if (!combo_deadline || deadline < combo_deadline)
+                    combo_deadline = deadline;
+                if (!timer_deadline || deadline < timer_deadline)
+                    timer_deadline = deadline;
+            }
+            if (!s->combo_open)
+                continue;
+            if (delta > 0) {
+                TRACE(MULTI_HELD_BACK, i, e.code, e.value);
+                if (!held)
+                    combo_held[combo_nheld++] = e.code, held = 1;
+            }
+        }
+
+        if (!s->can_toggle) {
+            nkeys = (s->is_down ? v->nbeforeup : v->nbeforedown);
+            s->can_toggle = (nkeys >= 0 ? ndown == nkeys : ndown != -nkeys);
+        }
+
+        if (s->can_toggle && (!s->is_down
+                    ? ndown == ntotal
+                    : (v->nup >= 0 ? ndown == v->nup : ndown != -v->nup))) {
+            int press[2];
+
+            s->is_down ^= 1;
+            press[0] = s->is_down ? v->down_press[0] : v->up_press[0];
+            press[1] = s->is_down ? v->down_press[1] : v->up_press[1];
+
+            nkeys = (s->is_down ? v->nbeforeup : v->nbeforedown);
+            s->can_toggle = (nkeys >= 0 ? ndown == nkeys : ndown != -nkeys);
+
+            TRACE(MULTI_TOGGLED, i, e.code, s->is_down);
+            if (s->is_down)
+                ++stats_multi[i].down;
+            else
+                ++stats_multi[i].up;
+            LATENCY_PATH(LATENCY_MULTI);
+
+            if (MULTI_COMBO(v) && s->is_down) {
+                int n = 0;
+
+                /* Keys of the chord have never been written: drop them, and
+                 * write the rest of the held back keys before it. */
+                s->combo_open = 0;
+                for (j = 0; j < combo_nheld; ++j) {
+                    int const code = combo_held[j];
+                    int l;
+
+                    for (l = 0; l < ntotal && keys[l] != code; ++l)
+                        ;
+                    if (l == ntotal)
+                        combo_held[n++] = code;
+                }
+                combo_nheld = n;
+                combo_flush();
+            }
+
+            if (!s->is_down) {
+                if (press[0] != KEY_RESERVED)
+                    write_key_event(press[0], EVENT_VALUE_KEYDOWN);
+
+                if (press[1] != KEY_RESERVED)
+                    write_key_event(press[1], EVENT_VALUE_KEYUP);
+            }
+
+            /* Keys of chords stay up until they are released. */
+            for (j = 0; !MULTI_COMBO(v) && j < ntotal; ++j) {
+                if (BITSET_GET(multi_keys_down, keys[j])) {
+                    /* Do not send release event if we will press it immediately (and vica-versa). */
+                    if (press[!s->is_down] == keys[j]) {
+                        press[!s->is_down] = KEY_RESERVED;
+                        continue;
+                    }
+
+                    write_key_event(keys[j], (s->is_down ? EVENT_VALUE_KEYUP : EVENT_VALUE_KEYDOWN));
+                }
+            }
+
+            if (s->is_down) {
+                if (press[0] != KEY_RESERVED)
+                    write_key_event(press[0], EVENT_VALUE_KEYDOWN);
+
+                if (press[1] != KEY_RESERVED)
+                    write_key_event(press[1], EVENT_VALUE_KEYUP);
+            }
+
+            ignore = 1;
+            continue;
+        } else if (s->is_down
+                && e.code == s->repeated_key
+                && v->down_press[0] != KEY_RESERVED && v->down_press[1] == KEY_RESERVED
+                && v->up_press[0]   == KEY_RESERVED && v->up_press[1]   == v->down_press[0]) {
+            TRACE(MULTI_REPEATED, i, v->down_press[0], e.value);
+            LATENCY_PATH(LATENCY_MULTI);
+            e.code = v->down_press[0];
+            break;
+        } else if (s->is_down) {
+            TRACE(MULTI_IGNORED, i, e.code, e.value);
+            ignore = 1;
+            continue;
+        }
+    }
+    if (ignore) {
+        ++stats->consumed;
+        return;
+    }
+    if (held)
+        return;
+
+write:
+    write_event(&e);
+}
+
+/** Fire timers due at `now`. Return the next deadline or 0. */
+static long long
+process_timers(long long now) {
+    long long next = 0;
+    int k, fired = 0;
+
+    for (k = 0; k < NTAP_TIMED; ++k) {
+        int const i = rules.tap_timed[k];
+        struct tap_conf const *const v = &rules.tap[i];
+        struct tap_cold *const c = &tap_cold[i];
+
+        if (!c->hold_deadline)
+            continue;
+
+        if (now < c->hold_deadline) {
+            if (!next || c->hold_deadline < next)
+                next = c->hold_deadline;
+            continue;
+        }
+
+        c->hold_deadline = 0;
+        if (tap_state[i].act_key != -1)
+            continue;
+
+        TRACE(TAP_HOLD_TIMEOUT, i, v->base_key, 1);
+        if (v->repeat_key != KEY_RESERVED)
+            tap_rule_repeat(i);
+        else if (TAP_ACTION_KEY(v) == KEY_RESERVED)
+            tap_rule_hold(i);
+        else
+            continue;
+        tap_update_active(i);
+        fired = 1;
+    }
+
+    if (NMULTI_TIMED && combo_deadline) {
+        if (now < combo_deadline) {
+            if (!next || combo_deadline < next)
+                next = combo_deadline;
+        } else {
+            combo_flush();
+            fired = 1;
+        }
+    }
+
+    if (fired) {
+        write_syn_report();
+        LATENCY_RESTORE();
+    }
+
+#ifdef CHAIN_STAGE
+    {
+        long long const next_stage = CHAIN_CAT(chain_stage_timers, CHAIN_NEXT)(now);
+        if (!next || (next_stage && next_stage < next))
+            next = next_stage;
+    }
+#endif
+    return next;
+}
+
+#if !defined BENCH && !defined CHAIN_LEN
+/** Everything the engine keeps about one device. Rule tables themselves are
+ * shared between devices; only their state is saved here. */
+struct engine_state {
+    int is_typing;
+    long long last_typing;
+    long curr_sec, curr_usec;
+    unsigned long matrix[BITSET_LEN(KEY_CNT)];
+    unsigned long *tap_active;
+    struct tap_state *tap;
+    struct tap_cold *tap_cold;
+    struct multi_state *multi;
+    unsigned long *multi_keys_down;
+    unsigned short *combo_held;
+    int combo_nheld;
+    long long combo_deadline;
+    unsigned char *layer_stack;
+    int layer_depth, layer_top, layer_tap;
+    unsigned short *layer_pressed;
+};
+
+static void
+engine_save(struct engine_state *s) {
+    s->is_typing = is_typing;
+    s->last_typing = last_typing;
+    s->curr_sec = curr_sec;
+    s->curr_usec = curr_usec;
+    memcpy(s->matrix, matrix, sizeof matrix);
+    s->tap_active = tap_active;
+    s->tap = tap_state;
+    s->tap_cold = tap_cold;
+    s->multi = multi_state;
+    s->multi_keys_down = multi_keys_down;
+    s->combo_held = combo_held;
+    s->combo_nheld = combo_nheld;
+    s->combo_deadline = combo_deadline;
+    s->layer_stack = layer_stack;
+    s->layer_depth = layer_depth;
+    s->layer_top = layer_top;
+    s->layer_tap = layer_tap;
+    s->layer_pressed = layer_pressed;
+}
+
+static void
+engine_load(struct engine_state const *s) {
+    is_typing = s->is_typing;
+    last_typing = s->last_typing;
+    curr_sec = s->curr_sec;
+    curr_usec = s->curr_usec;
+    memcpy(matrix, s->matrix, sizeof matrix);
+    tap_active = s->tap_active;
+    tap_state = s->tap;
+    tap_cold = s->tap_cold;
+    multi_state = s->multi;
+    multi_keys_down = s->multi_keys_down;
+    combo_held = s->combo_held;
+    combo_nheld = s->combo_nheld;
+    combo_deadline = s->combo_deadline;
+    layer_stack = s->layer_stack;
+    layer_depth = s->layer_depth;
+    layer_top = s->layer_top;
+    layer_tap = s->layer_tap;
+    layer_pressed = s->layer_pressed;
+}
+
+static void
+engine_free(struct engine_state *s) {
+    free(s->tap_active);
+    free(s->tap);
+    free(s->tap_cold);
+    free(s->multi);
+    free(s->multi_keys_down);
+    free(s->combo_held);
+    free(s->layer_stack);
+    free(s->layer_pressed);
+}
+
+/** Release keys that are down on the output. */
+static void
+release_keys(void) {
+    int i, released = 0;
+
+    /* Presses held back for chords have not been written yet, so there is
+     * nothing to release of them. Writing anything would flush them. */
+    combo_nheld = 0;
+    combo_deadline = 0;
+
+    for (i = 0; i < ARRAY_LEN(matrix); ++i) {
+        /* Releasing clears the bits. */
+        while (matrix[i]) {
+            write_key_event(i * LONG_BITS + __builtin_ctzl(matrix[i]), EVENT_VALUE_KEYUP);
+            released = 1;
+        }
+    }
+    if (released)
+        write_syn_report();
+}
+
+/* Rule files (see `-w` and `-r`) hold the rule tables and their dispatch
+ * index as the engine uses them, so they can be used right after mapping.
+ * Only k2k built from the same sources for the same architecture can read
+ * them; the header tells whether that is the case. */
+#define RULE_FILE_MAGIC "k2kR"
+#define RULE_FILE_VERSION 6
+
+struct rule_file_header {
+    char magic[4];
+    uint32_t version;
+    uint32_t key_cnt;
+    uint16_t map_size, tap_size, multi_size, layer_size; /** Sizes of rules. */
+    uint32_t nmap, ntap, nmulti, ntap_timed, nmulti_timed, nlayer, layer_max;
+};
+
+/* Sections after the header in order, each padded to 8 bytes. Index lengths
+ * are read from the end of the preceding `*_index_start` sections. */
+#define RULE_FILE_SECTIONS(SECTION, r) \
+    SECTION(map, (r)->nmap) \
+    SECTION(tap, (r)->ntap) \
+    SECTION(multi, (r)->nmulti) \
+    SECTION(layer, (r)->nlayer) \
+    SECTION(map_index, KEY_CNT) \
+    SECTION(layer_index, ((r)->layer_max + 1) * KEY_CNT) \
+    SECTION(tap_index_start, KEY_CNT + 1) \
+    SECTION(multi_index_start, KEY_CNT + 1) \
+    SECTION(tap_index, (r)->tap_index_start[KEY_CNT]) \
+    SECTION(multi_index, (r)->multi_index_start[KEY_CNT]) \
+    SECTION(multi_keys, (r)->multi_index_start[KEY_CNT]) \
+    SECTION(tap_timed, (r)->ntap_timed) \
+    SECTION(multi_timed, (r)->nmulti_timed)
+
+#define RULE_FILE_PAD(size) (((size) + 7) & ~(size_t)7)
+
+static int
+fwrite_padded(void const *p, size_t size, FILE *f) {
+    static char const PADDING[8];
+    size_t const npadding = RULE_FILE_PAD(size) - size;
+
+    return fwrite(p, 1, size, f) == size
+        && fwrite(PADDING, 1, npadding, f) == npadding;
+}
+
+/** Write `rules` to `path`. The file is replaced, not rewritten: executables
+ * that mapped it would see it change under them, or fault past its end. Return
+ * 0 on success, or -1 after telling why not. */
+static int
+rules_write(char const *path) {
+    struct rule_file_header const h = {
+        .magic = RULE_FILE_MAGIC,
+        .version = RULE_FILE_VERSION,
+        .key_cnt = KEY_CNT,
+        .map_size = sizeof *rules.map,
+        .tap_size = sizeof *rules.tap,
+        .multi_size = sizeof *rules.multi,
+        .layer_size = sizeof *rules.layer,
+        .nmap = rules.nmap,
+        .ntap = rules.ntap,
+        .nmulti = rules.nmulti,
+        .ntap_timed = rules.ntap_timed,
+        .nmulti_timed = rules.nmulti_timed,
+        .nlayer = rules.nlayer,
+        .layer_max = rules.layer_max,
+    };
+    char tmp_path[PATH_MAX];
+    FILE *f;
+    int ok;
+
+    if ((size_t)snprintf(tmp_path, sizeof tmp_path, "%s.tmp", path) >= sizeof tmp_path) {
+        fprintf(stderr, "%s: Path too long\n", path);
+        return -1;
+    }
+    if (!(f = fopen(tmp_path, "wb"))) {
+        perror(tmp_path);
+        return -1;
+    }
+
+    ok = fwrite_padded(&h, sizeof h, f);
+#define SECTION(field, n) \
+    ok = ok && fwrite_padded(rules.field, (n) * sizeof *rules.field, f);
+    RULE_FILE_SECTIONS(SECTION, &rules)
+#undef SECTION
+
+    if (fclose(f) || !ok) {
+        perror(tmp_path);
+        unlink(tmp_path);
+        return -1;
+    }
+    if (rename(tmp_path, path) < 0) {
+        perror(path);
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+/** Whether the mapped rules `r` only refer to existing keys and rules. */
+static int
+rules_valid(struct rules *r) {
+#define KEY_VALID(code) ((unsigned)(code) < KEY_CNT)
+    int i, j, code;
+
+    for (i = 0; i < r->nmap; ++i)
+        if (!KEY_VALID(r->map[i].from_key) || !KEY_VALID(r->map[i].to_key))
+            return 0;
+
+    r->check_typing = 0;
+    for (i = 0; i < r->ntap; ++i) {
+        struct tap_conf const *const v = &r->tap[i];
+        if (!KEY_VALID(v->base_key) || !KEY_VALID(v->tap_key)
+            || !KEY_VALID(v->hold_key) || !KEY_VALID(v->repeat_key)
+            || !KEY_VALID(v->action_key)
+            || v->first_sibling >= r->ntap
+            || (v->next_sibling != TAP_NO_SIBLING && v->next_sibling >= r->ntap))
+            return 0;
+        if (v->tap_typing)
+            r->check_typing = 1;
+    }
+
+    for (i = 0; i < r->nmulti; ++i) {
+        struct multi_conf const *const v = &r->multi[i];
+        if (v->keys_start + v->nkeys > r->multi_index_start[KEY_CNT])
+            return 0;
+        for (j = 0; j < 2; ++j)
+            if (!KEY_VALID(v->down_press[j]) || !KEY_VALID(v->up_press[j]))
+                return 0;
+    }
+
+    for (i = 0; i < r->nlayer; ++i) {
+        struct layer_conf const *const v = &r->layer[i];
+        if (!KEY_VALID(v->key) || !KEY_VALID(v->to_key) || !KEY_VALID(v->tap_key)
+            || v->layer < 1 || v->layer > r->layer_max)
+            return 0;
+    }
+#undef KEY_VALID
+
+    for (code = 0; code < KEY_CNT; ++code)
+        if (r->map_index[code] < -1 || r->map_index[code] >= r->nmap
+            || r->tap_index_start[code] > r->tap_index_start[code + 1]
+            || r->multi_index_start[code] > r->multi_index_start[code + 1])
+            return 0;
+    if (r->tap_index_start[0] || r->multi_index_start[0])
+        return 0;
+    for (i = 0; i < r->tap_index_start[KEY_CNT]; ++i)
+        if (r->tap_index[i] >= r->ntap)
+            return 0;
+    for (i = 0; i < r->multi_index_start[KEY_CNT]; ++i)
+        if (r->multi_index[i] >= r->nmulti)
+            return 0;
+    for (i = 0; i < r->multi_index_start[KEY_CNT]; ++i)
+        if (r->multi_keys[i] >= KEY_CNT)
+            return 0;
+    for (i = 0; i < r->ntap_timed; ++i)
+        if (r->tap_timed[i] >= r->ntap)
+            return 0;
+    for (i = 0; i < r->nmulti_timed; ++i)
+        if (r->multi_timed[i] >= r->nmulti)
+            return 0;
+    for (i = 0; i < (r->layer_max + 1) * KEY_CNT; ++i)
+        if (r->layer_index[i] < -1 || r->layer_index[i] >= r->nlayer)
+            return 0;
+    return 1;
+}
+
+/** Map rule file `path` and point `r` into it. Return the mapping of `*size`
+ * bytes, or `NULL` after telling why not. */
+static void *
+rules_map(char const *path, struct rules *r, size_t *size) {
+    struct rule_file_header const *h;
+    struct stat st;
+    char const *base;
+    size_t off;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+        perror(path);
+        if (fd >= 0)
+            close(fd);
+        return NULL;
+    }
+    if ((size_t)st.st_size < RULE_FILE_PAD(sizeof *h)) {
+        close(fd);
+        goto invalid_file;
+    }
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        perror(path);
+        return NULL;
+    }
+
+    h = (void const *)base;
+    if (memcmp(h->magic, RULE_FILE_MAGIC, sizeof h->magic)
+        || h->version != RULE_FILE_VERSION
+        || h->key_cnt != KEY_CNT
+        || h->map_size != sizeof *r->map
+        || h->tap_size != sizeof *r->tap
+        || h->multi_size != sizeof *r->multi
+        || h->layer_size != sizeof *r->layer
+        || h->nmap > SHRT_MAX || h->ntap > USHRT_MAX || h->nmulti > USHRT_MAX
+        || h->nlayer > SHRT_MAX || h->layer_max > UINT8_MAX
+        || h->ntap_timed > h->ntap || h->nmulti_timed > h->nmulti)
+        goto invalid;
+
+    memset(r, 0, sizeof *r);
+    r->nmap = h->nmap;
+    r->ntap = h->ntap;
+    r->nmulti = h->nmulti;
+    r->ntap_timed = h->ntap_timed;
+    r->nmulti_timed = h->nmulti_timed;
+    r->nlayer = h->nlayer;
+    r->layer_max = h->layer_max;
+
+    off = RULE_FILE_PAD(sizeof *h);
+#define SECTION(field, n) \
+    r->field = (void const *)(base + off); \
+    if ((size_t)st.st_size - off < (n) * sizeof *r->field) \
+        goto invalid; \
+    off += RULE_FILE_PAD((n) * sizeof *r->field); \
+    if (off > (size_t)st.st_size) \
+        goto invalid;
+    RULE_FILE_SECTIONS(SECTION, r)
+#undef SECTION
+
+    if (off != (size_t)st.st_size || !rules_valid(r))
+        goto invalid;
+    *size = st.st_size;
+    return (void *)base;
+
+invalid:
+    munmap((void *)base, st.st_size);
+invalid_file:
+    fprintf(stderr, "%s: Not a rule file of this k2k\n", path);
+    return NULL;
+}
+
+/** Mapping of `rule_path` that `rules` point into. */
+static void *rule_file;
+static size_t rule_file_size;
+
+/** Switch `rules` to those in `rule_path`. `release()`, if any, is called
+ * before, while the old rules, their state and counters are still in place.
+ * Return whether they have been switched; state of the old rules has to be
+ * reset then. */
+static int
+rules_remap(void (*release)(void)) {
+    struct rules r;
+    size_t size;
+    void *map;
 
-                    if (press[1] != KEY_RESERVED)
-                        write_key_event(press[1], EVENT_VALUE_KEYUP);
-                }
+    reload_pending = 0;
+    if (!(map = rules_map(rule_path, &r, &size)))
+        return 0;
 
-                for (j = 0; j < ntotal; ++j) {
-                    if ((v->keys_down >> j) & 1) {
-                        /* Do not send release event if we will press it immediately (and vica-versa). */
-                        if (press[!v->is_down] == v->keys[j]) {
-                            press[!v->is_down] = KEY_RESERVED;
-                            continue;
-                        }
+    if (release)
+        release();
+    if (rule_file)
+        munmap(rule_file, rule_file_size);
+    rules = r;
+    rule_file = map;
+    rule_file_size = size;
+    trace_add(TRACE_RULES_MAPPED, 0, 0, 0, realtime_usec());
 
-                        write_key_event(v->keys[j], (v->is_down ? EVENT_VALUE_KEYUP : EVENT_VALUE_KEYDOWN));
-                    }
-                }
+    stats_alloc();
+    if (stats_file)
+        stats_map_file();
+    return 1;
+}
 
-                if (v->is_down) {
-                    if (press[0] != KEY_RESERVED)
-                        write_key_event(press[0], EVENT_VALUE_KEYDOWN);
+static void
+reload_rules(void) {
+    if (rules_remap(release_keys)) {
+        state_reset();
+        flush_events();
+    }
+}
 
-                    if (press[1] != KEY_RESERVED)
-                        write_key_event(press[1], EVENT_VALUE_KEYUP);
-                }
+static void
+reload_request(int signum) {
+    (void)signum;
+    reload_pending = 1;
+}
+#endif
 
-                ignore = 1;
+#ifdef CHAIN_STAGE
+void
+CHAIN_STAGE_EVENT(CHAIN_STAGE)(struct input_event const *e) {
+    process_event(*e);
+}
+
+long long
+CHAIN_CAT(chain_stage_timers, CHAIN_STAGE)(long long now) {
+    return process_timers(now);
+}
+
+void
+CHAIN_CAT(chain_stage_keys, CHAIN_STAGE)(unsigned long *keys) {
+    rule_output_keys(keys);
+}
+
+void
+CHAIN_CAT(chain_stage_stats, CHAIN_STAGE)(char *base, size_t *off) {
+    stats_place(base, off);
+}
+
+void
+CHAIN_CAT(chain_stage_prefault, CHAIN_STAGE)(void) {
+    state_prefault();
+}
+#endif
+#endif /* CHAIN_DRIVER */
+
+#ifndef CHAIN_STAGE
+# ifdef CHAIN_DRIVER
+void
+CHAIN_STAGE_EVENT(CHAIN_LEN)(struct input_event const *e) {
+    output_event(e);
+}
+
+long long
+CHAIN_CAT(chain_stage_timers, CHAIN_LEN)(long long now) {
+    (void)now;
+    return 0;
+}
+
+void
+CHAIN_CAT(chain_stage_keys, CHAIN_LEN)(unsigned long *keys) {
+    (void)keys;
+}
+
+void
+CHAIN_CAT(chain_stage_stats, CHAIN_LEN)(char *base, size_t *off) {
+    (void)base, (void)off;
+}
+
+void
+CHAIN_CAT(chain_stage_prefault, CHAIN_LEN)(void) {
+}
+# endif
+
+#ifndef CHAIN_LEN
+/** Write the events just read as they are if no rule can act on them, i.e.
+ * there are no keys (or scan codes to drop). This is what a mouse or a
+ * touchpad sends most of the time. Return whether events were forwarded.
+ * They are counted, and traced as one `forwarded` record.
+ *
+ * Output is flushed before reading, so events can be written straight from
+ * `revbuf`. */
+static int
+forward_events(void) {
+    char const *buf = (char const *)revbuf;
+    size_t len = revlen * sizeof *revbuf;
+    size_t frame_len = wevframe_len;
+    size_t i;
+
+    for (i = 0; i < revlen; ++i) {
+        if (revbuf[i].type == EV_KEY || (revbuf[i].type == EV_MSC && revbuf[i].code == MSC_SCAN))
+            return 0;
+        if (revbuf[i].type == EV_SYN && revbuf[i].code == SYN_REPORT) {
+            /* It would end an empty frame. */
+            if (!frame_len)
+                return 0;
+            frame_len = 0;
+        } else {
+            ++frame_len;
+        }
+    }
+
+#ifdef URING
+    uring_wait_write();
+#endif
+    while (len > 0) {
+        struct iovec iov = { (void *)buf, len };
+        ssize_t const n = output_writev(&iov, 1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                handle_signals();
                 continue;
-            } else if (v->is_down
-                    && e.code == v->repeated_key
-                    && v->down_press[0] != KEY_RESERVED && v->down_press[1] == KEY_RESERVED
-                    && v->up_press[0]   == KEY_RESERVED && v->up_press[1]   == v->down_press[0]) {
-                dbgprintf("Multi rule #%d: Repeated.", i);
-                e.code = v->down_press[0];
+            }
+            exit(EXIT_FAILURE);
+        }
+        buf += n, len -= n;
+    }
+
+#ifdef LATENCY_STATS
+    latency_hist[LATENCY_PASSTHROUGH][63 - __builtin_clzll((monotonic_nsec() - read_stamp) | 1)] += revlen;
+#endif
+    /* Counted and traced once for all of them. */
+    stats->events_in += revlen;
+    stats->events_out += revlen;
+    trace_add(TRACE_FORWARDED, 0, revlen, 0, EVENT_TIME_USEC(revbuf[revlen - 1]));
+    wevframe_len = frame_len;
+    /* Events synthesized by timers are stamped with this. */
+    curr_sec = revbuf[revlen - 1].input_event_sec;
+    curr_usec = revbuf[revlen - 1].input_event_usec;
+    riev = revlen;
+    return 1;
+}
+#endif
+
+/** Process the events read last. */
+static void
+process_events(void) {
+#ifndef CHAIN_LEN
+    if (forward_events())
+        return;
+#endif
+    while (riev < revlen) {
+        long long const time = EVENT_TIME_USEC(revbuf[riev]) * 1000;
+
+        /* Timers due before an event fire before it, however late the
+         * event was read. */
+        if (timer_deadline && time >= timer_deadline)
+            timer_deadline = process_timers(time);
+#ifdef LATENCY_STATS
+        latency_stamp = read_stamp;
+        latency_path = LATENCY_PASSTHROUGH;
+#endif
+        process_event(revbuf[riev++]);
+    }
+
+    /* Not to wake up for timers of rules that have been resolved. Timers
+     * do not fire before their deadline. */
+    if (timer_stale) {
+        timer_stale = 0;
+        timer_deadline = process_timers(0);
+    }
+}
+
+/** Process events until end of input. */
+static void
+process_input(void) {
+    for (;;) {
+        flush_events();
+#ifndef BENCH
+        /* Output of the batch has been written by now. */
+        if (jitter_on && revlen > 0)
+            jitter_record();
+        if (record.fd >= 0 && revlen > 0)
+            record_batch();
+#endif
+        if (!read_events())
+            return;
+        process_events();
+    }
+}
+
+# if !defined BENCH && !defined CHAIN_LEN
+/* Daemon mode (`-s`): one process serves many devices. Rule tables and I/O
+ * buffers are shared; each device has its own file descriptors and engine
+ * state, which is swapped in when the device has input or a timer to fire.
+ *
+ * Devices are added and removed by writing `add DEVNODE` or
+ * `remove DEVNODE` lines to the control socket (see `-c`). Only the user
+ * running the daemon may connect, and only nodes in `DEVICE_DIR` are added.
+ * A device is grabbed once no key is down on it; until then it is pending. */
+
+/** Where devices may be added from. */
+# ifndef DEVICE_DIR
+#  define DEVICE_DIR "/dev/input/"
+# endif
+
+/** What an epoll event is about. */
+struct watch {
+    enum {
+        WATCH_DEVICE,
+        WATCH_CONTROL,
+        WATCH_CLIENT,
+        WATCH_TIMER,
+    } kind;
+    int fd;
+};
+
+struct device {
+    struct watch watch; /** Input. */
+    struct device *next;
+    char *path;
+    int output_fd; /** -1 while pending. */
+    long long timer_deadline;
+    size_t revcap;
+    size_t revpartial;
+    size_t wevframe_len;
+    char partial[sizeof(struct input_event)]; /** See `revpartial`. */
+    struct engine_state engine;
+};
+
+/** A connection to the control socket. */
+struct client {
+    struct watch watch;
+    size_t len;
+    char line[256];
+};
+
+static int epoll_fd;
+static struct watch control = { WATCH_CONTROL, -1 };
+static struct watch timer = { WATCH_TIMER, -1 };
+static struct device *devices;
+/** Devices removed while handling the current batch of epoll events. */
+static struct device *removed_devices;
+/** Device whose state is loaded. */
+static struct device *curr_device;
+
+static void
+watch_add(struct watch *w) {
+    struct epoll_event ev = {
+        .events = EPOLLIN,
+        .data.ptr = w,
+    };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, w->fd, &ev) < 0)
+        exit(EXIT_FAILURE);
+}
+
+/** Make `d` the current device. */
+static void
+device_enter(struct device *d) {
+    struct device *const prev = curr_device;
+
+    if (prev == d)
+        return;
+
+    if (prev) {
+        flush_events();
+        prev->timer_deadline = timer_deadline;
+        prev->revcap = revcap;
+        prev->revpartial = revpartial;
+        prev->wevframe_len = wevframe_len;
+        memcpy(prev->partial, &revbuf[revlen], revpartial);
+        engine_save(&prev->engine);
+    }
+
+    curr_device = d;
+    input_fd = d->watch.fd;
+    trace_device = input_fd;
+    output_fd = d->output_fd;
+    timer_deadline = d->timer_deadline;
+    revcap = d->revcap;
+    revlen = 0, riev = 0;
+    revpartial = d->revpartial;
+    wevframe_len = d->wevframe_len;
+    memcpy(revbuf, d->partial, revpartial);
+    engine_load(&d->engine);
+}
+
+/** Release keys that are down on the output of any device. */
+static void
+devices_release_keys(void) {
+    struct device *d;
+
+    for (d = devices; d; d = d->next) {
+        if (d->output_fd < 0)
+            continue;
+        device_enter(d);
+        release_keys();
+    }
+}
+
+static struct device *
+device_find(char const *path) {
+    struct device *d;
+
+    for (d = devices; d; d = d->next)
+        if (!strcmp(d->path, path))
+            return d;
+    return NULL;
+}
+
+/** Start serving pending device `d` if no key is down on it. Return 0 if it
+ * is served or still pending, or -1 if it cannot be served. */
+static int
+device_start(struct device *d) {
+    int const up = device_keys_up(d->watch.fd);
+    struct input_event seen[64];
+
+    if (up <= 0)
+        return up;
+    if (device_grab(d->path, d->watch.fd, &d->output_fd) < 0)
+        return -1;
+
+    /* Input from before the grab went to others already. */
+    fcntl(d->watch.fd, F_SETFL, O_NONBLOCK);
+    while (read(d->watch.fd, seen, sizeof seen) > 0)
+        ;
+    watch_add(&d->watch);
+    trace_add(TRACE_DEVICE_ADDED, 0, d->watch.fd, 0, realtime_usec());
+    return 0;
+}
+
+static void device_remove(struct device *d);
+
+static int
+device_add(char const *path) {
+    char real_path[PATH_MAX];
+    struct device *d;
+
+    if (device_find(path)) {
+        fprintf(stderr, "%s: Already added\n", path);
+        return -1;
+    }
+    if (!realpath(path, real_path)) {
+        perror(path);
+        return -1;
+    }
+    if (strncmp(real_path, DEVICE_DIR, strlen(DEVICE_DIR))) {
+        fprintf(stderr, "%s: Not in %s\n", path, DEVICE_DIR);
+        return -1;
+    }
+
+    if (!(d = calloc(1, sizeof *d)) || !(d->path = strdup(path)))
+        exit(EXIT_FAILURE);
+
+    if ((d->watch.fd = device_open(path)) < 0) {
+        free(d->path);
+        free(d);
+        return -1;
+    }
+
+    d->watch.kind = WATCH_DEVICE;
+    d->output_fd = -1;
+    d->revcap = MIN_READ_EVENTS;
+    device_enter(d);
+    state_reset();
+
+    d->next = devices;
+    devices = d;
+    if (device_start(d) < 0) {
+        device_remove(d);
+        return -1;
+    }
+    return 0;
+}
+
+/** Stop serving `d`. It is freed after the current batch of epoll events,
+ * that may still refer to it. */
+static void
+device_remove(struct device *d) {
+    struct device **p;
+
+    if (curr_device == d) {
+        flush_events();
+        engine_save(&d->engine);
+        curr_device = NULL;
+    }
+
+    for (p = &devices; *p != d; p = &(*p)->next)
+        ;
+    *p = d->next;
+    d->next = removed_devices;
+    removed_devices = d;
+
+    /* Also ungrabs it and destroys the uinput device, releasing keys it
+     * held down. */
+    if (d->output_fd >= 0) {
+        trace_add(TRACE_DEVICE_REMOVED, 0, d->watch.fd, 0, realtime_usec());
+        close(d->output_fd);
+    }
+    close(d->watch.fd);
+    d->watch.fd = -1;
+}
+
+static void
+device_read(struct device *d) {
+    device_enter(d);
+    switch (fill_events()) {
+    case -1:
+        if (errno == EINTR || errno == EAGAIN)
+            return;
+        /* E.g. ENODEV when unplugged. */
+        /* Fall through. */
+    case 0:
+        device_remove(d);
+        return;
+    }
+    process_events();
+}
+
+/** Fire timers of all devices, start pending ones, and arm the timer for the
+ * next. */
+static void
+device_timers(void) {
+    static long long armed_deadline;
+    long long const now = monotonic_nsec() + event_clock_offset;
+    long long next = 0;
+    struct device *d, *d_next;
+
+    for (d = devices; d; d = d_next) {
+        long long deadline;
+
+        d_next = d->next;
+        if (d->output_fd < 0) {
+            if (device_start(d) < 0)
+                device_remove(d);
+            else if (d->output_fd < 0 && (!next || now + DEVICE_POLL_NSEC < next))
+                next = now + DEVICE_POLL_NSEC;
+            continue;
+        }
+
+        deadline = d == curr_device ? timer_deadline : d->timer_deadline;
+        if (deadline && deadline <= now) {
+            device_enter(d);
+            deadline = timer_deadline = process_timers(now);
+        }
+        if (deadline && (!next || deadline < next))
+            next = deadline;
+    }
+
+    /* On the monotonic clock, which input read since may have moved the
+     * deadline on. */
+    if (next)
+        next -= event_clock_offset;
+    if (armed_deadline != next) {
+        struct itimerspec const its = {
+            .it_value = {
+                .tv_sec = next / 1000000000LL,
+                .tv_nsec = next % 1000000000LL,
+            },
+        };
+        timerfd_settime(timer.fd, TFD_TIMER_ABSTIME, &its, NULL);
+        armed_deadline = next;
+    }
+}
+
+/** Execute a control command and reply to `fd`. */
+static void
+control_command(int fd, char *line) {
+    char const *const cmd = strtok(line, " \t");
+    char const *const arg = strtok(NULL, " \t");
+    char reply[PATH_MAX + 8];
+    int ok = 0;
+    struct device *d;
+
+    *reply = '\0';
+    if (!cmd) {
+        return;
+    } else if (!strcmp(cmd, "add") && arg) {
+        ok = !device_add(arg);
+    } else if (!strcmp(cmd, "remove") && arg) {
+        if ((d = device_find(arg)))
+            device_remove(d), ok = 1;
+    } else if (!strcmp(cmd, "list") && !arg) {
+        for (d = devices; d; d = d->next) {
+            snprintf(reply, sizeof reply, "%s\n", d->path);
+            if (write(fd, reply, strlen(reply)) < 0)
+                return;
+        }
+        ok = 1;
+    }
+
+    snprintf(reply, sizeof reply, ok ? "ok\n" : "error\n");
+    if (write(fd, reply, strlen(reply)) < 0)
+        return;
+}
+
+static void
+client_read(struct client *c) {
+    ssize_t const len = read(c->watch.fd, c->line + c->len, sizeof c->line - 1 - c->len);
+    char *line, *end;
+
+    if (len < 0 && (errno == EINTR || errno == EAGAIN))
+        return;
+
+    c->len += len > 0 ? len : 0;
+    c->line[c->len] = '\0';
+    for (line = c->line; (end = strchr(line, '\n')); line = end + 1) {
+        *end = '\0';
+        control_command(c->watch.fd, line);
+    }
+    c->len -= line - c->line;
+    memmove(c->line, line, c->len);
+
+    if (len <= 0 || c->len == sizeof c->line - 1) {
+        /* Unterminated last line. */
+        c->line[c->len] = '\0';
+        control_command(c->watch.fd, c->line);
+        close(c->watch.fd);
+        free(c);
+    }
+}
+
+static void
+control_accept(void) {
+    struct client *c;
+    struct ucred cred;
+    socklen_t cred_len = sizeof cred;
+    int fd;
+
+    if ((fd = accept(control.fd, NULL, NULL)) < 0)
+        return;
+    /* The socket file is only writable by us too, but its mode does not
+     * guard sockets passed on or paths others could swap. */
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) < 0
+        || (cred.uid != geteuid() && cred.uid != 0)) {
+        close(fd);
+        return;
+    }
+
+    if (!(c = calloc(1, sizeof *c)))
+        exit(EXIT_FAILURE);
+    c->watch.kind = WATCH_CLIENT;
+    c->watch.fd = fd;
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    watch_add(&c->watch);
+}
+
+static int
+control_address(struct sockaddr_un *addr, char const *path) {
+    memset(addr, 0, sizeof *addr);
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof addr->sun_path) {
+        fprintf(stderr, "%s: Path too long\n", path);
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+/** Serve devices until killed. */
+static int
+serve(char const *socket_path, char *const *paths, int npaths) {
+    struct engine_state unused;
+    struct sockaddr_un addr;
+    struct stat st;
+    mode_t mask;
+    int i;
+
+    /* Every device gets its own state. */
+    engine_save(&unused);
+    engine_free(&unused);
+    memset(&unused, 0, sizeof unused);
+    engine_load(&unused);
+
+    if (control_address(&addr, socket_path) < 0)
+        return -1;
+
+    if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0
+        || (timer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0
+        || (control.fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        perror("k2k");
+        return -1;
+    }
+
+    /* Replace a socket left behind, but nothing else. */
+    if (!lstat(socket_path, &st) && S_ISSOCK(st.st_mode))
+        unlink(socket_path);
+    mask = umask(0177);
+    if (bind(control.fd, (struct sockaddr *)&addr, sizeof addr) < 0
+        || listen(control.fd, 8) < 0) {
+        perror(socket_path);
+        return -1;
+    }
+    umask(mask);
+
+    watch_add(&timer);
+    watch_add(&control);
+
+    for (i = 0; i < npaths; ++i)
+        device_add(paths[i]);
+
+    for (;;) {
+        struct epoll_event evs[16];
+        int n;
+
+        if (reload_pending && rules_remap(devices_release_keys)) {
+            struct device *d;
+            for (d = devices; d; d = d->next) {
+                device_enter(d);
+                state_reset();
+            }
+        }
+
+        flush_events();
+        device_timers();
+        flush_events();
+
+        if ((n = epoll_wait(epoll_fd, evs, ARRAY_LEN(evs), -1)) < 0) {
+            if (errno != EINTR)
+                return -1;
+            handle_signals();
+            continue;
+        }
+
+        for (i = 0; i < n; ++i) {
+            struct watch *const w = evs[i].data.ptr;
+            uint64_t nexpirations;
+
+            switch (w->kind) {
+            case WATCH_DEVICE:
+                if (w->fd >= 0)
+                    device_read((struct device *)w);
+                break;
+
+            case WATCH_CONTROL:
+                control_accept();
+                break;
+
+            case WATCH_CLIENT:
+                client_read((struct client *)w);
+                break;
+
+            case WATCH_TIMER:
+                if (read(timer.fd, &nexpirations, sizeof nexpirations) < 0 && errno != EAGAIN)
+                    return -1;
                 break;
-            } else if (v->is_down) {
-                dbgprintf("Multi rule #%d: Ignored matched key.", i);
-                ignore = 1;
-                continue;
             }
         }
-        if (ignore)
-            goto ignore_event;
 
-    write:
-        write_event(&e);
-    ignore_event:;
+        while (removed_devices) {
+            struct device *const d = removed_devices;
+            removed_devices = d->next;
+            engine_free(&d->engine);
+            free(d->path);
+            free(d);
+        }
+    }
+}
+
+/** Send a command line to the daemon at `socket_path` and print its reply.
+ * Return whether it succeeded. */
+static int
+control_client(char const *socket_path, char *const *argv, int argc) {
+    struct sockaddr_un addr;
+    char buf[PATH_MAX + 8];
+    size_t len = 0;
+    ssize_t n;
+    int fd, i, ok = 0;
+
+    for (i = 0; i < argc; ++i) {
+        size_t const arglen = strlen(argv[i]);
+        if (len + arglen + 2 > sizeof buf)
+            return 0;
+        if (i)
+            buf[len++] = ' ';
+        memcpy(buf + len, argv[i], arglen);
+        len += arglen;
+    }
+    buf[len++] = '\n';
+
+    if (control_address(&addr, socket_path) < 0)
+        return 0;
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0
+        || connect(fd, (struct sockaddr *)&addr, sizeof addr) < 0
+        || write(fd, buf, len) != (ssize_t)len) {
+        perror(socket_path);
+        return 0;
+    }
+    shutdown(fd, SHUT_WR);
+
+    while ((n = read(fd, buf, sizeof buf)) > 0) {
+        if (write(STDOUT_FILENO, buf, n) < 0)
+            return 0;
+        /* The reply ends with the status. */
+        ok = n >= 3 && !memcmp(buf + n - 3, "ok\n", 3);
+    }
+    return ok;
+}
+# endif
+
+# ifndef BENCH
+int
+main(int argc, char *argv[]) {
+#  ifndef CHAIN_LEN
+    char *socket_path = NULL;
+    char *write_path = NULL;
+    int client = 0;
+    int print_spec = 0;
+#  endif
+    char *trace_path = NULL;
+    char *record_path = NULL;
+    char *replay_path = NULL;
+    int replay_fast = 0;
+    char *cpus = NULL;
+    char *priority = NULL;
+    int lock = 0;
+    /* At most every argument is a device. On the stack, so that nothing is
+     * left to free however `main()` returns. */
+    char *paths[argc];
+    int npaths = 0;
+    int opt;
+
+#  ifndef CHAIN_LEN
+#   define OPTSTRING "d:s:c:r:w:St:T:m:R:p:P:lf:a:j"
+#  else
+#   define OPTSTRING "d:t:T:m:R:p:P:lf:a:j"
+#  endif
+    while ((opt = getopt(argc, argv, OPTSTRING)) != -1) {
+        switch (opt) {
+        case 'd':
+            paths[npaths++] = optarg;
+            break;
+        case 't':
+            trace_path = optarg;
+            break;
+        case 'm':
+            stats_path = optarg;
+            break;
+        case 'T':
+            return trace_read(optarg) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+        case 'R':
+            record_path = optarg;
+            break;
+        case 'P':
+            replay_fast = 1;
+            /* Fall through. */
+        case 'p':
+            replay_path = optarg;
+            break;
+        case 'l':
+            lock = 1;
+            break;
+        case 'f':
+            priority = optarg;
+            break;
+        case 'a':
+            cpus = optarg;
+            break;
+        case 'j':
+            jitter_init();
+            break;
+#  ifndef CHAIN_LEN
+        case 'c':
+            client = 1;
+            /* Fall through. */
+        case 's':
+            socket_path = optarg;
+            break;
+        case 'r':
+            rule_path = optarg;
+            break;
+        case 'w':
+            write_path = optarg;
+            break;
+        case 'S':
+            print_spec = 1;
+            break;
+#  endif
+        default:
+#  ifndef CHAIN_LEN
+            fprintf(stderr,
+                    "Usage: %s [-r RULEFILE] [-t TRACEFILE] [-m STATFILE] [-R RECORDFILE] [-l] [-f PRIORITY] [-a CPUS] [-j] [-d DEVNODE | -p|-P RECORDFILE]\n"
+                    "       %s [-r RULEFILE] [-t TRACEFILE] [-m STATFILE] [-l] [-f PRIORITY] [-a CPUS] -s SOCKET [-d DEVNODE]...\n"
+                    "       %s -c SOCKET add|remove DEVNODE\n"
+                    "       %s -c SOCKET list\n"
+                    "       %s [-r RULEFILE] -w RULEFILE\n"
+                    "       %s [-r RULEFILE] -S\n"
+                    "       %s -T TRACEFILE\n",
+                    argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0]);
+#  else
+            fprintf(stderr,
+                    "Usage: %s [-t TRACEFILE] [-m STATFILE] [-R RECORDFILE] [-l] [-f PRIORITY] [-a CPUS] [-j] [-d DEVNODE | -p|-P RECORDFILE]\n"
+                    "       %s -T TRACEFILE\n",
+                    argv[0], argv[0]);
+#  endif
+            return EXIT_FAILURE;
+        }
+    }
+#  undef OPTSTRING
+
+#ifdef LATENCY_STATS
+    latency_init();
+#endif
+    trace_init();
+    if (trace_path && trace_map(trace_path) < 0)
+        return EXIT_FAILURE;
+
+#  ifndef CHAIN_LEN
+    if (client)
+        return control_client(socket_path, argv + optind, argc - optind) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+#   ifdef SPECIALIZED
+    if (rule_path) {
+        fprintf(stderr, "%s: Specialized to its own rules, cannot use -r\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+#   endif
+    if (rule_path) {
+        struct sigaction sa;
+
+        if (!rules_remap(NULL))
+            return EXIT_FAILURE;
+        state_reset();
+
+        memset(&sa, 0, sizeof sa);
+        sa.sa_handler = reload_request;
+        sigaction(SIGHUP, &sa, NULL);
+    }
+    if (write_path)
+        return rules_write(write_path) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    if (print_spec) {
+        struct rule_spec f;
+
+        rules_spec(&f);
+#   define FIELD(name, field) printf("#define SPEC_" #name " %d\n", f.field);
+        RULE_SPEC_FIELDS(FIELD)
+#   undef FIELD
+        return EXIT_SUCCESS;
+    }
+#  endif
+
+    if (stats_path && stats_map_file() < 0)
+        return EXIT_FAILURE;
+
+    if (cpus && realtime_affinity(cpus) < 0) {
+        fprintf(stderr, "%s: Invalid CPU list: %s\n", argv[0], cpus);
+        return EXIT_FAILURE;
+    }
+    if (priority && realtime_priority(priority) < 0) {
+        fprintf(stderr, "%s: Invalid SCHED_FIFO priority: %s\n", argv[0], priority);
+        return EXIT_FAILURE;
+    }
+    if (lock)
+        realtime_lock();
+
+#  ifndef CHAIN_LEN
+    if (socket_path) {
+        if (record_path || replay_path) {
+            fprintf(stderr, "%s: Cannot record or replay with -s\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+        return serve(socket_path, paths, npaths), EXIT_FAILURE;
+    }
+#  endif
+
+    if (npaths > 1) {
+        fprintf(stderr, "%s: Multiple devices need -s\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (npaths == 1 && replay_path) {
+        fprintf(stderr, "%s: Cannot replay to a device\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (npaths == 1 && open_devices(paths[0], &input_fd, &output_fd) < 0)
+        return EXIT_FAILURE;
+    if (record_path && record_open(record_path) < 0)
+        return EXIT_FAILURE;
+    trace_device = input_fd;
+    if (replay_path) {
+        if (replay_open(replay_path, replay_fast) < 0)
+            return EXIT_FAILURE;
+    } else {
+#ifdef URING
+        uring_init();
+#endif
+#ifdef READER
+        reader_start();
+#endif
     }
+
+    process_input();
+    record_close();
+    if (jitter_on)
+        jitter_dump();
+#ifdef LATENCY_STATS
+    latency_dump();
+#endif
+    return EXIT_FAILURE;
 }
+# endif
+#endif /* CHAIN_STAGE */
 /* vi:set ft=c: */
@@ -0,0 +1,55 @@
+/* Counters of what rules did, as k2k keeps them in the file given by
+ * `-m STATFILE` and k2k-stat reads them.
+ *
+ * The file is a header followed by one section per configuration (i.e. per
+ * stage of a fused chain). k2k updates counters with plain increments from
+ * its engine thread; readers may see them a little behind. When the rules
+ * change (on SIGHUP) k2k writes a new file in place of the old one, with
+ * counters starting from zero. */
+#include <stdint.h> /* uint*_t */
+
+#define STATS_MAGIC "k2kC"
+#define STATS_VERSION 4
+
+struct stats_header {
+    char magic[4];
+    uint32_t version;
+    uint32_t nstages;
+    uint32_t ring_size; /** Events the reader thread can hold, or 0 without
+                          one. */
+    uint32_t ring_high; /** Most events it held at once. */
+    uint32_t ring_full; /** How many times it filled up. */
+};
+
+/** Counters of a configuration, followed by `nmap` `uint64_t` map rule
+ * hits, `ntap` `struct stats_tap`, `nmulti` `struct stats_multi` and `nlayer`
+ * `uint64_t` layer rule hits. */
+struct stats_stage {
+    char name[32]; /** Name of the configuration. */
+    uint32_t nmap, ntap, nmulti, nlayer;
+    uint64_t events_in, events_out;
+    uint64_t scan_dropped; /** `MSC_SCAN` events dropped. */
+    uint64_t map_dropped; /** Events mapped to `KEY_RESERVED`. */
+    uint64_t consumed; /** Events tap, multi or layer switching rules did not
+                         pass on. */
+};
+
+struct stats_tap {
+    uint64_t tapped; /** Also counts taps while typing. */
+    uint64_t held;
+    uint64_t repeated;
+    uint64_t late_tap;
+    uint64_t ignored; /** Released after it was held with other keys. */
+};
+
+struct stats_multi {
+    uint64_t down, up;
+    uint64_t missed; /** Windows of `combo_ms` that closed without a chord. */
+};
+
+#define STATS_STAGE_SIZE(nmap, ntap, nmulti, nlayer) \
+    (sizeof(struct stats_stage) \
+     + (nmap) * sizeof(uint64_t) \
+     + (ntap) * sizeof(struct stats_tap) \
+     + (nmulti) * sizeof(struct stats_multi) \
+     + (nlayer) * sizeof(uint64_t))
@@ -0,0 +1,20 @@
+#!/bin/sh
+# A key pressed, released and pressed again within one frame is written as it
+# is; transitions that leave the key as it was are dropped.
+. "${0%/*}/common"
+
+make -s CONFIG_DIR=tests/configs $OUT/chord
+
+{
+    event '\001' $KEY_X $DOWN
+    event '\001' $KEY_X $UP
+    event '\001' $KEY_X $DOWN
+    syn
+    event '\001' $KEY_X $DOWN
+    event '\001' $KEY_Q $UP
+    syn
+    key $KEY_X $UP
+} >"$dir/in"
+$OUT/chord <"$dir/in" >"$dir/out" || :
+
+expect_keys "$dir/out" '45 1\n45 0\n45 1\n45 0\n'
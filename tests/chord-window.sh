@@ -0,0 +1,32 @@
+#!/bin/sh
+# Keys of a chord pressed within its window (`.combo_ms`, 60 seconds) of the
+# first one, by the timestamps of input events, act as the chord. Presses held
+# back are written once the window closes, another key is pressed or one of
+# them repeats.
+. "${0%/*}/common"
+
+make -s CONFIG_DIR=tests/configs $OUT/chord
+
+{
+    TIME='\0' key $KEY_J $DOWN
+    TIME='\073' key $KEY_K $DOWN
+    TIME='\074' key $KEY_J $UP
+    TIME='\074' key $KEY_K $UP
+    # 65 seconds apart.
+    TIME='\100' key $KEY_J $DOWN
+    TIME='\201' key $KEY_K $DOWN
+    TIME='\201' key $KEY_J $UP
+    TIME='\201' key $KEY_K $UP
+    TIME='\202' key $KEY_J $DOWN
+    TIME='\202' key $KEY_X $DOWN
+    TIME='\202' key $KEY_X $UP
+    TIME='\202' key $KEY_J $UP
+    TIME='\203' key $KEY_K $DOWN
+    TIME='\203' key $KEY_K $REPEAT
+    TIME='\203' key $KEY_J $DOWN
+    TIME='\203' key $KEY_J $UP
+    TIME='\203' key $KEY_K $UP
+} >"$dir/in"
+$OUT/chord <"$dir/in" >"$dir/out" || :
+
+expect_keys "$dir/out" '1 1\n1 0\n36 1\n37 1\n36 0\n37 0\n36 1\n45 1\n45 0\n36 0\n37 1\n37 2\n36 1\n36 0\n37 0\n'
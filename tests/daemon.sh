@@ -0,0 +1,53 @@
+#!/bin/sh
+# Add, list and remove devices of a daemon (-s) over its socket. Devices keep
+# their own state: a chord of keys pressed on two of them is no chord.
+. "${0%/*}/common"
+
+make -s CONFIG_DIR=tests/configs $OUT/chord
+standin_build chord
+k2k=$dir/chord
+
+mkfifo "$dir/kbd1" "$dir/kbd2"
+$k2k -s "$dir/sock" -d "$dir/kbd1" 2>"$dir/log" &
+pid=$!
+trap 'kill $pid 2>/dev/null || :; rm -rf "$dir"' EXIT
+i=0
+while [ ! -S "$dir/sock" ]; do
+    [ $((i += 1)) -lt 100 ] || { echo "$0: No socket" >&2; exit 1; }
+    sleep 0.05
+done
+[ "$(stat -c %a "$dir/sock")" = 600 ] || { echo "$0: Socket is not private" >&2; exit 1; }
+
+fail() {
+    echo "$0: $*" >&2
+    exit 1
+}
+ctl() {
+    $k2k -c "$dir/sock" "$@" >"$dir/reply"
+}
+
+ctl add "$dir/kbd2" || fail "add failed"
+! ctl add "$dir/kbd2" || fail "added a device twice"
+! ctl add /dev/null || fail "added a device outside its directory"
+ctl list
+printf '%s\n' "$dir/kbd2" "$dir/kbd1" ok | cmp -s - "$dir/reply" || fail "wrong list"
+
+exec 3>"$dir/kbd1" 4>"$dir/kbd2"
+key $KEY_J $DOWN >&3
+key $KEY_K $DOWN >&4
+key $KEY_J $UP >&3
+key $KEY_K $UP >&4
+sleep 0.2
+
+ctl remove "$dir/kbd2" || fail "remove failed"
+! ctl remove "$dir/kbd2" || fail "removed a device twice"
+ctl list
+printf '%s\n' "$dir/kbd1" ok | cmp -s - "$dir/reply" || fail "wrong list after remove"
+key $KEY_X $DOWN >&3
+key $KEY_X $UP >&3
+sleep 0.2
+kill $pid
+wait $pid || :
+
+expect_keys "$dir/kbd1.out" '36 1\n36 0\n45 1\n45 0\n'
+expect_keys "$dir/kbd2.out" '37 1\n37 0\n'
@@ -0,0 +1,23 @@
+#!/bin/sh
+# With -d, events are read from the device and written to its output device
+# instead of stdin and stdout.
+. "${0%/*}/common"
+
+standin_build hold
+k2k=$dir/hold
+
+{
+    TIME='\0' key $KEY_A $DOWN
+    TIME='\001' key $KEY_A $UP
+    TIME='\002' key $KEY_A $DOWN
+    TIME='\005' key $KEY_A $UP
+    TIME='\006' key $KEY_X $DOWN
+    TIME='\006' key $KEY_X $UP
+} >"$dir/kbd"
+# It exits with failure at the end of a regular file.
+$k2k -d "$dir/kbd" </dev/null >"$dir/out" || :
+
+[ ! -s "$dir/out" ] || { echo "$0: Wrote to stdout" >&2; exit 1; }
+expect_keys "$dir/kbd.out" '30 1\n30 0\n29 1\n29 0\n45 1\n45 0\n'
+
+! $k2k -d "$dir/none" 2>/dev/null || { echo "$0: Opened no device" >&2; exit 1; }
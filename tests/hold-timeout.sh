@@ -0,0 +1,19 @@
+#!/bin/sh
+# Hold timeouts run on the timestamps of input events: a key released after
+# the timeout acts as its hold key however fast the events are read, and one
+# released before acts as its tap key.
+. "${0%/*}/common"
+
+make -s CONFIG_DIR=tests/configs $OUT/hold
+
+{
+    TIME='\0' key $KEY_A $DOWN
+    TIME='\001' key $KEY_A $UP
+    TIME='\002' key $KEY_A $DOWN
+    TIME='\005' key $KEY_A $UP
+    TIME='\006' key $KEY_X $DOWN
+    TIME='\006' key $KEY_X $UP
+} >"$dir/in"
+$OUT/hold <"$dir/in" >"$dir/out" || :
+
+expect_keys "$dir/out" '30 1\n30 0\n29 1\n29 0\n45 1\n45 0\n'
@@ -0,0 +1,32 @@
+#!/bin/sh
+# Layers switched on by holding and toggling keys. Keys are looked up on the
+# layer switched on last only, and released as what they were pressed as.
+. "${0%/*}/common"
+
+make -s CONFIG_DIR=tests/configs $OUT/layer
+
+tap() {
+    key $1 $DOWN
+    key $1 $UP
+}
+
+{
+    # Tapped alone, a hold key is its tap key.
+    tap $KEY_Q
+    key $KEY_Q $DOWN; tap $KEY_J; key $KEY_Q $UP
+    key $KEY_Q $DOWN; key $KEY_K $DOWN; key $KEY_Q $UP; key $KEY_K $UP
+    tap $KEY_W
+    tap $KEY_J; tap $KEY_K
+    key $KEY_Q $DOWN; tap $KEY_J; tap $KEY_X; key $KEY_Q $UP
+    key $KEY_X $DOWN; tap $KEY_W; key $KEY_X $UP
+    tap $KEY_J
+} >"$dir/in"
+$OUT/layer <"$dir/in" >"$dir/out" || :
+
+expect_keys "$dir/out" '16 1\n16 0\n2 1\n2 0\n3 1\n3 0\n30 1\n30 0\n37 1\n37 0\n2 1\n2 0\n45 1\n45 0\n31 1\n31 0\n36 1\n36 0\n'
+
+# The same from a rule file.
+make -s CONFIG_DIR=tests/configs $OUT/hold
+$OUT/layer -w "$dir/rules"
+$OUT/hold -r "$dir/rules" <"$dir/in" >"$dir/out.r" || :
+cmp -s "$dir/out" "$dir/out.r" || { echo "$0: Rule file differs" >&2; exit 1; }
@@ -0,0 +1,31 @@
+#!/bin/sh
+# Input recorded with -R replays (-p, -P) to the same output, timers
+# included, and recordings are traces of `bench-<config>` too.
+. "${0%/*}/common"
+
+make -s CONFIG_DIR=tests/configs $OUT/hold
+
+{
+    TIME='\0' key $KEY_A $DOWN
+    TIME='\001' key $KEY_A $UP
+    TIME='\002' key $KEY_A $DOWN
+    TIME='\005' key $KEY_A $UP
+    TIME='\006' key $KEY_X $DOWN
+    TIME='\006' key $KEY_X $UP
+} >"$dir/in"
+$OUT/hold -R "$dir/rec" <"$dir/in" >"$dir/out" || :
+expect_keys "$dir/out" '30 1\n30 0\n29 1\n29 0\n45 1\n45 0\n'
+
+for replay in -p -P; do
+    $OUT/hold $replay "$dir/rec" </dev/null >"$dir/out.replay" || :
+    cmp -s "$dir/out" "$dir/out.replay" || {
+        echo "$0: Replay with $replay differs" >&2
+        exit 1
+    }
+done
+
+make -s CONFIG_DIR=tests/configs $OUT/bench-hold
+$OUT/bench-hold hold "$dir/rec" | grep -q '"events":12,' || {
+    echo "$0: Recording is no trace of bench" >&2
+    exit 1
+}
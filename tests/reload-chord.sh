@@ -0,0 +1,30 @@
+#!/bin/sh
+# Reload rules (SIGHUP) while a chord key is held back and another key is
+# down on the output. The other key has to be released, and the held back key
+# must never be written: it was not pressed on the output.
+. "${0%/*}/common"
+
+make -s CONFIG_DIR=tests/configs $OUT/chord
+make -s $OUT/media-keys
+
+$OUT/chord -w "$dir/rules"
+mkfifo "$dir/in"
+$OUT/chord -r "$dir/rules" <"$dir/in" >"$dir/out" &
+pid=$!
+exec 3>"$dir/in"
+
+key $KEY_X $DOWN >&3
+key $KEY_J $DOWN >&3
+sleep 0.2
+# Rules with more multi rules than before.
+$OUT/media-keys -w "$dir/rules.tmp"
+mv "$dir/rules.tmp" "$dir/rules"
+kill -HUP $pid
+sleep 0.2
+key $KEY_J $UP >&3
+key $KEY_X $UP >&3
+exec 3>&-
+# It exits with failure at the end of input.
+wait $pid || :
+
+expect_keys "$dir/out" '45 1\n45 0\n'
@@ -0,0 +1,66 @@
+#!/bin/sh
+# Executables started with -r use the rules of the file instead of their own,
+# refuse files that are not rule files of theirs, and keep their rules when a
+# file they are to reload (SIGHUP) cannot be used.
+. "${0%/*}/common"
+
+make -s CONFIG_DIR=tests/configs $OUT/chord $OUT/hold
+
+fail() {
+    echo "$0: $*" >&2
+    exit 1
+}
+
+$OUT/chord -w "$dir/chord.rules"
+$OUT/hold -w "$dir/hold.rules"
+# Header intact, the rest garbage.
+{
+    head -c 48 "$dir/chord.rules"
+    tr '\0' '\377' </dev/zero | head -c $(($(wc -c <"$dir/chord.rules") - 48))
+} >"$dir/garbage.rules"
+head -c 100 "$dir/chord.rules" >"$dir/short.rules"
+: >"$dir/empty.rules"
+
+for f in garbage short empty none; do
+    ! $OUT/hold -r "$dir/$f.rules" </dev/null >/dev/null 2>&1 \
+        || fail "started with $f.rules"
+done
+
+chord() {
+    key $KEY_J $DOWN
+    key $KEY_K $DOWN
+    key $KEY_J $UP
+    key $KEY_K $UP
+}
+
+chord >"$dir/in"
+$OUT/hold -r "$dir/chord.rules" <"$dir/in" >"$dir/out" || :
+expect_keys "$dir/out" '1 1\n1 0\n'
+
+cp "$dir/chord.rules" "$dir/rules"
+mkfifo "$dir/fifo"
+$OUT/hold -r "$dir/rules" <"$dir/fifo" >"$dir/out" 2>"$dir/log" &
+pid=$!
+exec 3>"$dir/fifo"
+chord >&3
+# Until then SIGHUP may come before its handler.
+sleep 0.2
+for f in garbage short chord; do
+    cp "$dir/$f.rules" "$dir/rules.tmp"
+    mv "$dir/rules.tmp" "$dir/rules"
+    kill -HUP $pid
+    sleep 0.2
+    chord >&3
+done
+# -w replaces the file, so the mapped rules stay as they are until SIGHUP.
+$OUT/hold -w "$dir/rules"
+chord >&3
+sleep 0.2
+kill -HUP $pid
+sleep 0.2
+chord >&3
+exec 3>&-
+wait $pid || :
+
+grep -q 'Not a rule file' "$dir/log" || fail "reload of a bad file was not told"
+expect_keys "$dir/out" '1 1\n1 0\n1 1\n1 0\n1 1\n1 0\n1 1\n1 0\n1 1\n1 0\n36 1\n37 1\n36 0\n37 0\n'